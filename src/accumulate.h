@@ -0,0 +1,31 @@
+#pragma once
+#include <immintrin.h>
+#include "targets.h"
+
+BFTILE_TARGET_AVX512VNNI_BEGIN
+
+namespace bftile {
+/************************************************************************************ accumulation ************************************************************************************/
+// How the multiply-adds add into the int32 accumulator. The drivers that take one of these as their Accumulate parameter call
+// Accumulate::dot(acc, a, b) wherever they used to call dpbusds directly.
+//
+// Either way each dot product of 4 uint8 x int8 pairs is exact; the difference is only in the final addition to the accumulator.
+// Saturating clips it to the int32 range, NonSaturating wraps around. A single product is at most 255*128, so a row of C can only
+// leave the int32 range when the width is above roughly 66k. Wrapping has the advantage that a running sum which goes out of
+// range and comes back in, as sums of mixed signs can, still ends up exact, while a clipped one is off for good.
+
+struct Saturating {
+  static inline __m128i dot(__m128i acc, __m128i a, __m128i b) { return _mm_dpbusds_epi32(acc, a, b); }
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpbusds_epi32(acc, a, b); }
+  static inline __m512i dot(__m512i acc, __m512i a, __m512i b) { return _mm512_dpbusds_epi32(acc, a, b); }
+};
+
+struct NonSaturating {
+  static inline __m128i dot(__m128i acc, __m128i a, __m128i b) { return _mm_dpbusd_epi32(acc, a, b); }
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpbusd_epi32(acc, a, b); }
+  static inline __m512i dot(__m512i acc, __m512i a, __m512i b) { return _mm512_dpbusd_epi32(acc, a, b); }
+};
+
+} // namespace bftile
+
+BFTILE_TARGET_END
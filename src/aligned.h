@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdlib>
+#include <memory>
 #include <new>
 #ifdef _MSC_VER
 #include <malloc.h>
@@ -49,3 +50,15 @@ template <class T> class AlignedVector {
     T *mem_;
     std::size_t size_;
 };
+
+// At least bytes of 512-byte aligned memory that belongs to the calling thread. It is kept for the next call and only
+// reallocated when a larger one is asked for, so kernels that need a scratch buffer on every call don't go to the allocator
+// each time. The contents are whatever the last user of the thread left there.
+inline void *threadScratch(std::size_t bytes) {
+  static thread_local std::unique_ptr<AlignedVector<char>> scratch;
+  if (!scratch || scratch->size() < bytes) {
+    scratch.reset();
+    scratch.reset(new AlignedVector<char>(bytes));
+  }
+  return scratch->begin();
+}
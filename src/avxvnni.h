@@ -0,0 +1,110 @@
+#pragma once
+#include <immintrin.h>
+#include "utils.h"
+#include "maddubs.h"
+#include "targets.h"
+
+/************************************************************************************ AVX-VNNI ************************************************************************************/
+// The cores without AVX512 (Alder Lake and later client cores, Sierra Forest) have dpbusd only in its VEX encoded form,
+// AVX-VNNI: 256 bit registers, 16 of them and no masks. mm256.h can't run there, since its dpbusds is the EVEX one and
+// everything around it uses AVX512VL masks. The kernels here are avx2::anyshape from maddubs.h with the dot products done by
+// the _avx_ dpbusd intrinsics. B is prepared by avx2::anyshape, which is the layout of mm256::anyshape, and so for shapes
+// that are multiples of the tile also that of mm256::depthfirst.
+
+BFTILE_TARGET_AVXVNNI_BEGIN
+namespace bftile {
+namespace avxvnni {
+
+// The Accumulate policies of accumulate.h, in their VEX encoding
+struct Saturating {
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpbusds_avx_epi32(acc, a, b); }
+};
+
+struct NonSaturating {
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpbusd_avx_epi32(acc, a, b); }
+};
+
+// Any shape, like mm256::anyshape. The 8 accumulators, A, its two permuted copies and a register of B fit in the 16 ymm
+// registers there are without AVX512, as long as the multiply-adds take B straight from memory.
+template<class Accumulate>
+struct anyshapeWith {
+  typedef avx2::anyshape Prepare;
+  typedef __m256i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+  static const constexpr uint32_t registerBits = 8*sizeof(Register); // What the prepared B looks like, for serialize.h
+  static const constexpr PreparedLayout layout = PreparedLayout::anyshape;
+
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return Prepare::preparedSize(rowsB, colsB);
+  }
+
+  static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    Prepare::prepareBMatrix(in, out, rowsB, colsB);
+  }
+
+  static void prepareBMatrixBlock(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB, size_t colBegin, size_t colEnd) {
+    Prepare::prepareBMatrixBlock(in, out, rowsB, colsB, colBegin, colEnd);
+  }
+
+  // One row of A against one tile of B, mm256::depthfirstaddrlooptileloopwritedepend::multiplyRowSeqWrite
+  static inline void multiplyRow(const Register a, const Register * breord, Register &res) {
+    auto static const constexpr mask1 = _MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
+    auto static const constexpr mask2 = _MM_SHUFFLE(1,0,2,3);
+    auto static const constexpr mask3 = _MM_SHUFFLE(0,1,3,2);
+
+    res = Accumulate::dot(res, a, breord[0]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(a, mask1), breord[1]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(a, mask2), breord[2]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(a, mask3), breord[3]);
+
+    const Register laneSwappedA = _mm256_permute2x128_si256(a, a, 0b0101);
+    res = Accumulate::dot(res, laneSwappedA, breord[4]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(laneSwappedA, mask1), breord[5]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(laneSwappedA, mask2), breord[6]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(laneSwappedA, mask3), breord[7]);
+  }
+
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // Same contract as mm256::anyshape::gemmBlock
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    const size_t tiles = Prepare::tilesPerColumn(width);
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*numregs;
+    Register cres[numregs];
+    for (size_t j = colBegin; j < colEnd; j += numregs) { // 32/4=8
+      const Register colmask = Prepare::columnMask(colEnd - j);
+      for (size_t i = rowBegin; i < rowEnd; i += numregs) { // 32/4=8
+        const size_t rows = rowEnd - i < numregs ? rowEnd - i : numregs;
+        for (size_t n = 0; n < rows; n++) {
+          cres[n] = _mm256_maskload_epi32(reinterpret_cast<const int *>(C + (i+n)*colsB + j), colmask);
+        }
+        const Register * breord_cur = breord + (kBegin/regwidth)*numregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) {
+          for (size_t n = 0; n < rows; n++) {
+            multiplyRow(Prepare::loadPadded(A + (i+n)*width + t, width - t), breord_cur, cres[n]);
+          }
+          breord_cur = breord_cur + numregs; // 32/4=8
+        }
+        for (size_t n = 0; n < rows; n++) {
+          _mm256_maskstore_epi32(reinterpret_cast<int *>(C + (i+n)*colsB + j), colmask, cres[n]);
+        }
+      }
+      breord = breord + tiles*numregs;
+    }
+  }
+
+  struct runner {
+    using gemm = anyshapeWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct anyshape
+typedef anyshapeWith<Saturating> anyshape;
+
+} // namespace avxvnni
+} // namespace bftile
+BFTILE_TARGET_END
@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <tuple>
+#include <vector>
+#include "threadpool.h"
+
+namespace bftile {
+/************************************************************************************ batched driver ************************************************************************************/
+
+// One multiplication of a batch: C += A*B with B prepared by the runner's prepareB, same contract as runner::gemm
+struct GemmProblem {
+  const uint8_t * A;
+  const int8_t * B;
+  int32_t * C;
+  size_t rowsA;
+  size_t width;
+  size_t colsB;
+};
+
+// Many small independent multiplications in one call, as the attention heads or experts of a layer issue them. Calling
+// runner::gemm for each of them wakes the pool every time and, when several of them share a B, streams the same B as often.
+// Here problems with the same prepared B are grouped and multiplied one column block of B at a time, every problem of the
+// group in turn, so the column block is still in L1 when the next problem needs it. The groups are cut into tasks of about
+// minWorkPerTask multiply-adds along the columns, and ThreadPool::run hands those out one at a time, so threads that are done
+// with theirs take the next one instead of waiting. A batch too small to be worth waking the pool runs on the calling thread.
+// The wrapped gemm needs gemmBlock() and numregs, and any shape as for parallel<>.
+template<class Runner>
+struct batched {
+  typedef typename Runner::gemm Kernel;
+
+  static const constexpr size_t minWorkPerTask = 1 << 18;
+  static const constexpr size_t minWorkForPool = 1 << 20; // Multiply-adds in the whole batch before it goes to the pool
+
+  // Problems [first, last) of the grouped order against the columns [colBegin, colEnd) of their B
+  struct Task {
+    size_t first;
+    size_t last;
+    size_t colBegin;
+    size_t colEnd;
+  };
+
+  static void gemm(const GemmProblem * problems, size_t count) {
+    gemm(problems, count, ThreadPool::instance());
+  }
+
+  static void gemm(const GemmProblem * problems, size_t count, ThreadPool &pool) {
+    /****** Important: every C is assumed to be set to 0 ******/
+    const size_t numregs = Kernel::numregs;
+    // Problems sharing a B end up next to each other
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return std::make_tuple(reinterpret_cast<uintptr_t>(problems[a].B), problems[a].width, problems[a].colsB, a)
+           < std::make_tuple(reinterpret_cast<uintptr_t>(problems[b].B), problems[b].width, problems[b].colsB, b);
+    });
+
+    std::vector<Task> tasks;
+    size_t totalWork = 0;
+    for (size_t first = 0; first < count;) {
+      const GemmProblem &head = problems[order[first]];
+      size_t last = first;
+      size_t groupRows = 0;
+      while (last < count && problems[order[last]].B == head.B && problems[order[last]].width == head.width
+             && problems[order[last]].colsB == head.colsB) {
+        groupRows += problems[order[last]].rowsA;
+        last++;
+      }
+      // As many column blocks per task as it takes to get to minWorkPerTask
+      const size_t blockWork = std::max<size_t>(groupRows*head.width*numregs, 1);
+      const size_t blocksPerTask = std::max<size_t>(minWorkPerTask/blockWork, 1);
+      for (size_t colBegin = 0; colBegin < head.colsB; colBegin += blocksPerTask*numregs) {
+        tasks.push_back({first, last, colBegin, std::min(colBegin + blocksPerTask*numregs, head.colsB)});
+      }
+      totalWork += groupRows*head.width*head.colsB;
+      first = last;
+    }
+
+    if (pool.size() == 1 || tasks.size() == 1 || totalWork < minWorkForPool) {
+      for (const Task &task : tasks) {
+        run(problems, order, task);
+      }
+    } else {
+      pool.run(tasks.size(), [&](size_t task) {
+        run(problems, order, tasks[task]);
+      });
+    }
+  }
+
+  private:
+    static void run(const GemmProblem * problems, const std::vector<size_t> &order, const Task &task) {
+      const size_t numregs = Kernel::numregs;
+      for (size_t j = task.colBegin; j < task.colEnd; j += numregs) {
+        const size_t jEnd = std::min(j + numregs, task.colEnd);
+        for (size_t p = task.first; p < task.last; p++) {
+          const GemmProblem &problem = problems[order[p]];
+          Kernel::gemmBlock(problem.A, problem.B, problem.C, problem.width, problem.colsB, 0, problem.rowsA, j, jEnd, 0, problem.width);
+        }
+      }
+    }
+};
+
+} // namespace bftile
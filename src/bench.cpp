@@ -0,0 +1,589 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "aligned.h"
+#include "mm128.h"
+#include "mm256.h"
+#include "mm512.h"
+#include "maddubs.h"
+#include "avxvnni.h"
+#include "int4.h"
+#include "sparse.h"
+#include "parallel.h"
+#include "blocked.h"
+#include "batched.h"
+#include "fixed.h"
+#include "accumulate.h"
+#include "dispatch.h"
+#include "perf.h"
+#include "utils.h"
+#include "do_not_optimize.h"
+
+/************************************************************************************ Benchmark suite ************************************************************************************/
+// Times the runners on a list of shapes and reports median and p99 time per call, GOPS and the fraction of the VNNI peak of the
+// machine, along with the GB/s of B its prepareBMatrix gets through. Every (runner, shape) pair is set up once, and the prepare
+// and the gemm are each warmed up and then timed one call at a time until their median settles.
+// Run with --help for the options. Built with BFTILE_PERF, it also counts hardware events per call (see perf.h), in a separate
+// pass after the timing so the counters don't get in the way of the clock. Runners that use a pool of more than one thread get
+// no counts, since only the calling thread is counted.
+
+namespace {
+
+// Everything the suite needs to know about a runner
+struct Runner {
+  std::string name;
+  size_t registerBits; // Width of the dpbusds it uses, for the peak
+  bool threaded; // Uses the whole ThreadPool
+  // Shapes have to be multiples of these
+  size_t rowsMultiple;
+  size_t widthMultiple;
+  size_t colsMultiple;
+  size_t (*preparedSize)(size_t rowsB, size_t colsB);
+  void (*prepareBMatrix)(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB);
+  void (*gemm)(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB);
+  bool (*supported)(); // Whether the CPU has the instructions the runner needs
+};
+
+// For runners of RegisterBits wide registers that need whole tiles: rows and columns multiples of numregs (one int32 per lane),
+// the width a multiple of regwidth (one int8 per lane)
+template<size_t RegisterBits, class R>
+Runner tiled(const std::string &name, bool threaded = false) {
+  return {name, RegisterBits, threaded, RegisterBits/32, RegisterBits/8, RegisterBits/32, R::prepareB::preparedSize,
+          R::prepareB::prepareBMatrix, R::gemm::gemm, bftile::cpu::avx512vnni};
+}
+
+// For runners that take any shape
+template<size_t RegisterBits, class R>
+Runner anyShape(const std::string &name, bool threaded = false) {
+  return {name, RegisterBits, threaded, 1, 1, 1, R::prepareB::preparedSize, R::prepareB::prepareBMatrix, R::gemm::gemm,
+          bftile::cpu::avx512vnni};
+}
+
+// The families that run on less than AVX512VNNI: AVX-VNNI (avxvnni.h) and the maddubs fallbacks of maddubs.h. The peak of
+// the fallbacks is still that of dpbusds at the same width, so the peak fraction says how far they are from the VNNI kernels.
+template<size_t RegisterBits, class R>
+Runner fallback(const std::string &name, bool (*supported)(), bool threaded = false) {
+  Runner runner = anyShape<RegisterBits, R>(name, threaded);
+  runner.supported = supported;
+  return runner;
+}
+
+// The rows of a shape as a batch of problems of at most 16 rows each, all of them sharing the B
+template<class R>
+struct batchedRows {
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    std::vector<bftile::GemmProblem> problems;
+    for (size_t i = 0; i < rowsA; i += 16) {
+      problems.push_back({A + i*width, B, C + i*colsB, std::min<size_t>(16, rowsA - i), width, colsB});
+    }
+    bftile::batched<R>::gemm(problems.data(), problems.size());
+  }
+};
+
+// The shapes of the default list that fit, everything else takes the generic loops
+typedef bftile::fixedShapes<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner, bftile::Shape<64, 16>, bftile::Shape<256, 256>,
+                            bftile::Shape<320, 320>> mm512Fixed;
+
+// The register width of the backend the dispatcher picked, from its name
+size_t backendBits() {
+  const std::string name = bftile::backend().name;
+  return name == "mm512" || name == "avx512bw" ? 512 : name == "mm256" || name == "avxvnni" || name == "avx2" ? 256 : name == "mm128" ? 128 : 32;
+}
+
+std::vector<Runner> runners() {
+  using namespace bftile;
+  Runner dispatchedRunner = {std::string("dispatched/") + backend().name, backendBits(), true, backend().rowsMultiple, backend().widthMultiple,
+                             backend().colsMultiple, backend().preparedSize, backend().prepareBMatrix, backend().gemm,
+                             backend().supported};
+  Runner batchedRunner = anyShape<512, mm512::anyshape::runner>("mm512/batched-anyshape", true);
+  batchedRunner.gemm = batchedRows<mm512::anyshape::runner>::gemm;
+  return {
+    tiled<128, breadthfirst::runner>("mm128/breadthfirst"),
+    tiled<128, depthfirst::runner>("mm128/depthfirst"),
+    tiled<128, depthfirstaddr::runner>("mm128/depthfirstaddr"),
+    tiled<128, depthfirstaddrloop::runner>("mm128/depthfirstaddrloop"),
+    tiled<128, depthfirstaddrlooptileloop::runner>("mm128/depthfirstaddrlooptileloop"),
+    tiled<128, depthfirstaddrlooptileloopwritedepend::runner>("mm128/depthfirstaddrlooptileloopwritedepend"),
+    tiled<128, registeraccumulated<>::runner>("mm128/registeraccumulated"),
+    anyShape<128, anyshape::runner>("mm128/anyshape"),
+    anyShape<128, packedA::runner>("mm128/packedA"),
+    tiled<256, mm256::depthfirstaddrlooptileloopwritedepend::runner>("mm256/depthfirstaddrlooptileloopwritedepend"),
+    tiled<256, mm256::registeraccumulated<>::runner>("mm256/registeraccumulated"),
+    anyShape<256, mm256::anyshape::runner>("mm256/anyshape"),
+    anyShape<256, mm256::packedA::runner>("mm256/packedA"),
+    tiled<512, mm512::depthfirstaddrlooptileloopwritedepend::runner>("mm512/depthfirstaddrlooptileloopwritedepend"),
+    tiled<512, parallel<mm512::depthfirstaddrlooptileloopwritedepend::runner>::runner>("mm512/parallel-depthfirstaddrlooptileloopwritedepend", true),
+    tiled<512, mm512::registerblocked<1>::runner>("mm512/registerblocked1"),
+    tiled<512, mm512::registerblocked<2>::runner>("mm512/registerblocked2"),
+    tiled<512, mm512::registerblocked<3>::runner>("mm512/registerblocked3"),
+    tiled<512, mm512::registerblocked<4>::runner>("mm512/registerblocked4"),
+    tiled<512, mm512::registeraccumulated<4>::runner>("mm512/registeraccumulated4"),
+    tiled<512, mm512::registeraccumulated<8>::runner>("mm512/registeraccumulated8"),
+    tiled<512, mm512::registeraccumulated<16>::runner>("mm512/registeraccumulated16"),
+    tiled<512, mm512Fixed::runner>("mm512/fixed"),
+    tiled<512, mm512::prefetched<1>::runner>("mm512/prefetched1"),
+    tiled<512, mm512::prefetched<2>::runner>("mm512/prefetched2"),
+    tiled<512, mm512::prefetched<4>::runner>("mm512/prefetched4"),
+    tiled<512, mm512::prefetched<8>::runner>("mm512/prefetched8"),
+    tiled<512, mm512::prefetched<0, true>::runner>("mm512/prefetched0-streamc"),
+    anyShape<512, mm512::anyshape::runner>("mm512/anyshape"),
+    anyShape<512, mm512::anyshapeWith<NonSaturating>::runner>("mm512/anyshape-nonsaturating"),
+    anyShape<512, parallel<mm512::anyshape::runner>::runner>("mm512/parallel-anyshape", true),
+    anyShape<512, blocked<mm512::anyshape::runner>::runner>("mm512/blocked-anyshape"),
+    anyShape<512, mm512::packedA::runner>("mm512/packedA"),
+    anyShape<512, mm512::packedAWith<NonSaturating>::runner>("mm512/packedA-nonsaturating"),
+    anyShape<512, mm512::gemv::runner>("mm512/gemv"),
+    anyShape<512, int4::mm512::anyshape::runner>("int4/mm512/anyshape"),
+    anyShape<512, parallel<int4::mm512::anyshape::runner>::runner>("int4/mm512/parallel-anyshape", true),
+    anyShape<512, int4::mm512::gemv::runner>("int4/mm512/gemv"),
+    anyShape<512, sparse::mm512::anyshape::runner>("sparse/mm512/anyshape"),
+    anyShape<512, sparse::mm512::parallelGemm<sparse::mm512::anyshape::runner>>("sparse/mm512/parallel-anyshape", true),
+    fallback<256, avx2::anyshape::runner>("avx2/anyshape", cpu::avx2),
+    fallback<256, parallel<avx2::anyshape::runner>::runner>("avx2/parallel-anyshape", cpu::avx2, true),
+    fallback<256, avxvnni::anyshape::runner>("avxvnni/anyshape", cpu::avxvnni),
+    fallback<256, parallel<avxvnni::anyshape::runner>::runner>("avxvnni/parallel-anyshape", cpu::avxvnni, true),
+    fallback<512, avx512bw::anyshape::runner>("avx512bw/anyshape", cpu::avx512bw),
+    fallback<512, parallel<avx512bw::anyshape::runner>::runner>("avx512bw/parallel-anyshape", cpu::avx512bw, true),
+    batchedRunner,
+    dispatchedRunner,
+  };
+}
+
+// The shapes benchmark() in demo.cpp used to time
+std::vector<bftile::matrix> defaultShapes() {
+  return {{16, 64, 16}, {16, 256, 256}, {16, 2048, 256}, {320, 256, 256}, {480, 256, 256}, {240, 256, 256}, {208, 256, 256},
+          {256, 256, 256}, {1024, 1024, 1024}, {4096, 4096, 128}, {640, 320, 320}};
+}
+
+struct Options {
+  std::vector<bftile::matrix> shapes;
+  std::vector<std::string> filters; // Substrings of runner names, empty for all of them
+  std::string format = "table";
+  std::string output; // Empty for stdout
+  double warmupTime = 0.05; // Seconds
+  double minTime = 0.2; // Seconds of samples at the least, unless maxSamples is reached first
+  double maxTime = 2.0; // Seconds of samples at the most, whether the median has settled or not
+  size_t minSamples = 20;
+  size_t maxSamples = 100000;
+  double ghz = 0; // 0 for what the OS says
+  size_t ports = 2; // dpbusds issued per cycle
+  double zeroTiles = 0; // Fraction of the tiles of B that are zero, for the block sparse runners
+  bool list = false;
+};
+
+void usage(const char * name) {
+  std::cerr << "Usage: " << name << " [options]\n"
+    "  --shape MxKxN        time rowsA=M, width=K, colsB=N. Can be repeated. Defaults to the shapes of the old demo benchmark.\n"
+    "  --shapes FILE        read shapes from FILE, one per line as MxKxN or M K N. # starts a comment.\n"
+    "  --runner SUBSTRING   only time runners whose name contains SUBSTRING. Can be repeated.\n"
+    "  --list               list the runners and exit.\n"
+    "  --format FORMAT      table (default), csv or json.\n"
+    "  --output FILE        write the results to FILE instead of stdout.\n"
+    "  --min-time SECONDS   time every pair for at least this long, default 0.2.\n"
+    "  --max-time SECONDS   and at most this long, default 2.\n"
+    "  --ghz GHZ            clock for the peak, defaults to the current clock from /proc/cpuinfo.\n"
+    "  --ports N            dpbusds per cycle for the peak, default 2.\n"
+    "  --zero-tiles FRAC    zero the fraction FRAC of the 64x16 tiles of B, as in a pruned model. Default 0.\n";
+}
+
+bool parseShape(const std::string &text, bftile::matrix &shape) {
+  std::string spaced = text;
+  std::replace(spaced.begin(), spaced.end(), 'x', ' ');
+  std::istringstream in(spaced);
+  std::string rest;
+  return static_cast<bool>(in >> shape.aRows >> shape.width >> shape.bCols) && !(in >> rest) && shape.aRows && shape.width && shape.bCols;
+}
+
+bool readShapes(const std::string &path, std::vector<bftile::matrix> &shapes) {
+  std::ifstream in(path);
+  if (!in) {
+    std::cerr << "Can't open " << path << std::endl;
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {
+      continue;
+    }
+    bftile::matrix shape;
+    if (!parseShape(line, shape)) {
+      std::cerr << "Can't parse the shape '" << line << "' in " << path << std::endl;
+      return false;
+    }
+    shapes.push_back(shape);
+  }
+  return true;
+}
+
+bool parseOptions(int argc, char ** argv, Options &options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (arg == "--help" || arg == "-h") {
+      return false;
+    } else if (arg == "--list") {
+      options.list = true;
+    } else if (arg == "--shape" && hasValue) {
+      bftile::matrix shape;
+      if (!parseShape(argv[++i], shape)) {
+        std::cerr << "Can't parse the shape '" << argv[i] << "'" << std::endl;
+        return false;
+      }
+      options.shapes.push_back(shape);
+    } else if (arg == "--shapes" && hasValue) {
+      if (!readShapes(argv[++i], options.shapes)) {
+        return false;
+      }
+    } else if (arg == "--runner" && hasValue) {
+      options.filters.push_back(argv[++i]);
+    } else if (arg == "--format" && hasValue) {
+      options.format = argv[++i];
+      if (options.format != "table" && options.format != "csv" && options.format != "json") {
+        std::cerr << "Unknown format " << options.format << std::endl;
+        return false;
+      }
+    } else if (arg == "--output" && hasValue) {
+      options.output = argv[++i];
+    } else if (arg == "--min-time" && hasValue) {
+      options.minTime = std::atof(argv[++i]);
+    } else if (arg == "--max-time" && hasValue) {
+      options.maxTime = std::atof(argv[++i]);
+    } else if (arg == "--ghz" && hasValue) {
+      options.ghz = std::atof(argv[++i]);
+    } else if (arg == "--ports" && hasValue) {
+      options.ports = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--zero-tiles" && hasValue) {
+      options.zeroTiles = std::atof(argv[++i]);
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return false;
+    }
+  }
+  if (options.shapes.empty()) {
+    options.shapes = defaultShapes();
+  }
+  return true;
+}
+
+// The clock of the first core as /proc/cpuinfo has it, 0 if there is none
+double cpuGhz() {
+  std::ifstream in("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(in, line)) {
+    if (line.compare(0, 7, "cpu MHz") == 0) {
+      size_t colon = line.find(':');
+      if (colon != std::string::npos) {
+        return std::atof(line.c_str() + colon + 1)/1000.0;
+      }
+    }
+  }
+  return 0;
+}
+
+struct Result {
+  std::string runner;
+  bftile::matrix shape;
+  size_t threads;
+  size_t samples;
+  double median; // Seconds per call
+  double p99;
+  double min;
+  double gops;
+  double peakFraction; // 0 when the peak is unknown
+  double bGBps; // Prepared B read per second, what limits skinny shapes
+  double prepareMedian; // Seconds per prepareBMatrix
+  double prepareGBps; // B prepared per second, in bytes of the original B
+  bftile::perf::Stats gemmCounts; // Hardware events, when built with BFTILE_PERF
+  bftile::perf::Stats prepareCounts;
+};
+
+double percentile(std::vector<double> sorted, double fraction) {
+  std::sort(sorted.begin(), sorted.end());
+  const size_t rank = static_cast<size_t>(std::ceil(fraction*sorted.size()));
+  return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+}
+
+// Times call(), which returns the seconds it took, after warming up: in rounds of samples until the median stops moving, or
+// until we run out of time or samples
+template<class Call>
+std::vector<double> sample(const Call &call, const Options &options) {
+  // Warm up the caches, the page tables, the clock and the thread pool
+  double spent = 0;
+  for (size_t i = 0; i < 2 || spent < options.warmupTime; i++) {
+    spent += call();
+  }
+
+  std::vector<double> samples;
+  double previousMedian = 0;
+  spent = 0;
+  while (samples.size() < options.maxSamples) {
+    for (size_t i = 0; i < options.minSamples; i++) {
+      samples.push_back(call());
+      spent += samples.back();
+    }
+    const double median = percentile(samples, 0.5);
+    const bool settled = std::abs(median - previousMedian) <= 0.01*median;
+    previousMedian = median;
+    if ((settled && spent >= options.minTime) || spent >= options.maxTime) {
+      break;
+    }
+  }
+  return samples;
+}
+
+Result measure(const Runner &runner, const bftile::matrix &shape, const Options &options) {
+  using namespace bftile;
+  typedef std::chrono::steady_clock Clock;
+  AlignedVector<uint8_t> A(shape.aRows*shape.width);
+  AlignedVector<int8_t> B(shape.width*shape.bCols);
+  AlignedVector<int8_t> BReord(runner.preparedSize(shape.width, shape.bCols));
+  AlignedVector<int32_t> C(shape.aRows*shape.bCols);
+  for (size_t i = 0; i < A.size(); i++) {
+    A[i] = i % 255;
+  }
+  for (size_t i = 0; i < B.size(); i++) {
+    B[i] = i % 255;
+  }
+  // The same tiles for every runner, spread evenly over B
+  for (size_t j = 0, tile = 0; j < shape.bCols; j += 16) {
+    for (size_t w = 0; w < shape.width; w += 64, tile++) {
+      if (std::floor((tile + 1)*options.zeroTiles) > std::floor(tile*options.zeroTiles)) {
+        for (size_t col = j; col < std::min<size_t>(j + 16, shape.bCols); col++) {
+          std::fill(B.begin() + col*shape.width + w, B.begin() + col*shape.width + std::min<size_t>(w + 64, shape.width), 0);
+        }
+      }
+    }
+  }
+  std::fill(C.begin(), C.end(), 0);
+  // The counters only see the calling thread (see perf.h), so for a runner that spreads over a pool of more than one thread
+  // they would show its share of the work only. Those are left unavailable.
+  const bool countable = !runner.threaded || ThreadPool::instance().size() == 1;
+  perf::Counters &counters = perf::threadCounters();
+  perf::Stats prepareCounts;
+  if (countable) {
+    counters.start();
+  }
+  runner.prepareBMatrix(B.begin(), BReord.begin(), shape.width, shape.bCols);
+  if (countable) {
+    prepareCounts = counters.stop();
+  }
+
+  // Preparing B is done once per model load, but a slow one is what users wait for at startup
+  const std::vector<double> prepareSamples = sample([&]() {
+    auto start = Clock::now();
+    runner.prepareBMatrix(B.begin(), BReord.begin(), shape.width, shape.bCols);
+    auto end = Clock::now();
+    doNotOptimizeAway(BReord.begin());
+    return std::chrono::duration<double>(end - start).count();
+  }, options);
+
+  // C keeps accumulating from one call to the next, which costs the same as starting from zero every time
+  const std::vector<double> samples = sample([&]() {
+    auto start = Clock::now();
+    runner.gemm(A.begin(), BReord.begin(), C.begin(), shape.aRows, shape.width, shape.bCols);
+    auto end = Clock::now();
+    doNotOptimizeAway(C.begin());
+    return std::chrono::duration<double>(end - start).count();
+  }, options);
+
+  // Count as many calls again as were timed, up to a second's worth, bracketing them all at once so that turning the counters
+  // on and off doesn't add to small shapes
+  perf::Stats gemmCounts;
+  if (perf::enabled && countable) {
+    const size_t calls = std::max<size_t>(1, std::min<size_t>(samples.size(), 1.0/percentile(samples, 0.5)));
+    counters.start();
+    for (size_t i = 0; i < calls; i++) {
+      runner.gemm(A.begin(), BReord.begin(), C.begin(), shape.aRows, shape.width, shape.bCols);
+    }
+    gemmCounts = counters.stop();
+    gemmCounts.calls = calls;
+    doNotOptimizeAway(C.begin());
+  }
+
+  Result result;
+  result.runner = runner.name;
+  result.shape = shape;
+  result.threads = runner.threaded ? ThreadPool::instance().size() : 1;
+  result.samples = samples.size();
+  result.median = percentile(samples, 0.5);
+  result.p99 = percentile(samples, 0.99);
+  result.min = *std::min_element(samples.begin(), samples.end());
+  const double ops = 2.0*shape.aRows*shape.width*shape.bCols; // A multiply and an add per element of the product
+  result.gops = ops/result.median/1e9;
+  // A dpbusds does 4 multiply-adds in each of registerBits/32 lanes
+  const double ghz = options.ghz ? options.ghz : cpuGhz();
+  const double peak = ghz*options.ports*(runner.registerBits/32)*4*2*result.threads; // GOPS
+  result.peakFraction = peak > 0 ? result.gops/peak : 0;
+  result.bGBps = BReord.size()/result.median/1e9;
+  result.prepareMedian = percentile(prepareSamples, 0.5);
+  result.prepareGBps = B.size()/result.prepareMedian/1e9;
+  result.gemmCounts = gemmCounts;
+  result.prepareCounts = prepareCounts;
+  return result;
+}
+
+void writeTable(std::ostream &out, const std::vector<Result> &results) {
+  out << std::left << std::setw(56) << "runner" << std::setw(18) << "shape" << std::right << std::setw(8) << "threads"
+      << std::setw(9) << "samples" << std::setw(14) << "median(us)" << std::setw(14) << "p99(us)" << std::setw(10) << "GOPS"
+      << std::setw(8) << "peak" << std::setw(10) << "B GB/s" << std::setw(12) << "prep GB/s";
+  if (bftile::perf::enabled) {
+    for (size_t event = 0; event < bftile::perf::eventCount; event++) {
+      out << std::setw(14) << bftile::perf::eventName(event);
+    }
+    out << std::setw(8) << "IPC";
+  }
+  out << "\n";
+  for (const Result &r : results) {
+    std::ostringstream shape;
+    shape << r.shape.aRows << "x" << r.shape.width << "x" << r.shape.bCols;
+    out << std::left << std::setw(56) << r.runner << std::setw(18) << shape.str() << std::right << std::setw(8) << r.threads
+        << std::setw(9) << r.samples << std::fixed << std::setprecision(2) << std::setw(14) << r.median*1e6 << std::setw(14) << r.p99*1e6
+        << std::setw(10) << r.gops << std::setw(7) << r.peakFraction*100 << "%" << std::setw(10) << r.bGBps
+        << std::setw(12) << r.prepareGBps;
+    if (bftile::perf::enabled) {
+      // Per call, - for the events this machine can't count or that weren't counted (threaded runners)
+      const bftile::perf::Stats &counts = r.gemmCounts;
+      out << std::setprecision(0);
+      for (size_t event = 0; event < bftile::perf::eventCount; event++) {
+        out << std::setw(14);
+        if (counts.available[event]) {
+          out << counts.perCall(event);
+        } else {
+          out << "-";
+        }
+      }
+      out << std::setprecision(2) << std::setw(8);
+      if (counts.available[bftile::perf::cycles] && counts.available[bftile::perf::instructions] && counts.values[bftile::perf::cycles]) {
+        out << counts.perCall(bftile::perf::instructions)/counts.perCall(bftile::perf::cycles);
+      } else {
+        out << "-";
+      }
+    }
+    out << "\n";
+    out.unsetf(std::ios::fixed);
+  }
+}
+
+void writeCsv(std::ostream &out, const std::vector<Result> &results) {
+  out << "runner,rowsA,width,colsB,threads,samples,median_s,p99_s,min_s,gops,peak_fraction,b_gbps,prepare_median_s,prepare_gbps";
+  if (bftile::perf::enabled) {
+    for (const char * prefix : {"gemm_", "prepare_"}) {
+      for (size_t event = 0; event < bftile::perf::eventCount; event++) {
+        out << "," << prefix << bftile::perf::eventName(event);
+      }
+    }
+  }
+  out << "\n" << std::setprecision(9);
+  for (const Result &r : results) {
+    out << r.runner << "," << r.shape.aRows << "," << r.shape.width << "," << r.shape.bCols << "," << r.threads << "," << r.samples
+        << "," << r.median << "," << r.p99 << "," << r.min << "," << r.gops << "," << r.peakFraction << "," << r.bGBps << ","
+        << r.prepareMedian << "," << r.prepareGBps;
+    if (bftile::perf::enabled) {
+      // Per call, empty for the events this machine can't count
+      for (const bftile::perf::Stats * counts : {&r.gemmCounts, &r.prepareCounts}) {
+        for (size_t event = 0; event < bftile::perf::eventCount; event++) {
+          out << ",";
+          if (counts->available[event]) {
+            out << counts->perCall(event);
+          }
+        }
+      }
+    }
+    out << "\n";
+  }
+}
+
+void writeJson(std::ostream &out, const std::vector<Result> &results) {
+  out << "[\n" << std::setprecision(9);
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    out << "  {\"runner\": \"" << r.runner << "\", \"rowsA\": " << r.shape.aRows << ", \"width\": " << r.shape.width
+        << ", \"colsB\": " << r.shape.bCols << ", \"threads\": " << r.threads << ", \"samples\": " << r.samples
+        << ", \"median_s\": " << r.median << ", \"p99_s\": " << r.p99 << ", \"min_s\": " << r.min << ", \"gops\": " << r.gops
+        << ", \"peak_fraction\": " << r.peakFraction << ", \"b_gbps\": " << r.bGBps << ", \"prepare_median_s\": " << r.prepareMedian
+        << ", \"prepare_gbps\": " << r.prepareGBps;
+    if (bftile::perf::enabled) {
+      // Per call, null for the events this machine can't count
+      const char * prefixes[] = {"gemm_", "prepare_"};
+      const bftile::perf::Stats * counts[] = {&r.gemmCounts, &r.prepareCounts};
+      for (size_t c = 0; c < 2; c++) {
+        for (size_t event = 0; event < bftile::perf::eventCount; event++) {
+          out << ", \"" << prefixes[c] << bftile::perf::eventName(event) << "\": ";
+          if (counts[c]->available[event]) {
+            out << counts[c]->perCall(event);
+          } else {
+            out << "null";
+          }
+        }
+      }
+    }
+    out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "]\n";
+}
+
+} // namespace
+
+int main(int argc, char ** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<Runner> selected;
+  for (const Runner &runner : runners()) {
+    bool wanted = options.filters.empty();
+    for (const std::string &filter : options.filters) {
+      wanted = wanted || runner.name.find(filter) != std::string::npos;
+    }
+    if (wanted && !runner.supported()) {
+      std::cerr << "Skipping " << runner.name << ", this CPU doesn't have the instructions it needs." << std::endl;
+    } else if (wanted) {
+      selected.push_back(runner);
+    }
+  }
+  if (options.list) {
+    for (const Runner &runner : selected) {
+      std::cout << runner.name << "\n";
+    }
+    return 0;
+  }
+
+  std::vector<Result> results;
+  for (const Runner &runner : selected) {
+    for (const bftile::matrix &shape : options.shapes) {
+      if (shape.aRows % runner.rowsMultiple || shape.width % runner.widthMultiple || shape.bCols % runner.colsMultiple) {
+        continue; // Not a shape this runner can do
+      }
+      results.push_back(measure(runner, shape, options));
+    }
+  }
+
+  std::ofstream file;
+  if (!options.output.empty()) {
+    file.open(options.output);
+    if (!file) {
+      std::cerr << "Can't open " << options.output << " for writing" << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &out = options.output.empty() ? std::cout : file;
+  if (options.format == "csv") {
+    writeCsv(out, results);
+  } else if (options.format == "json") {
+    writeJson(out, results);
+  } else {
+    writeTable(out, results);
+  }
+  return 0;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <unistd.h>
+
+namespace bftile {
+/************************************************************************************ cache blocking ************************************************************************************/
+
+struct CacheSizes {
+  size_t l1;
+  size_t l2;
+  size_t l3;
+};
+
+// Data cache sizes of the machine we run on, per core for L1 and L2. Falls back to common server values when the OS won't say.
+inline CacheSizes detectCacheSizes() {
+  CacheSizes sizes = {32*1024, 1024*1024, 8*1024*1024};
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+  long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE);
+  long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (l1 > 0) sizes.l1 = static_cast<size_t>(l1);
+  if (l2 > 0) sizes.l2 = static_cast<size_t>(l2);
+  if (l3 > 0) sizes.l3 = static_cast<size_t>(l3);
+#endif
+  return sizes;
+}
+
+// Whether a kernel writes C = A*B instead of accumulating C += A*B, which it says with overwritesC = true (see
+// mm512::prefetched with StreamC). Kernels without the member accumulate.
+template<class Kernel, class = void>
+struct overwritesC : std::false_type {};
+template<class Kernel>
+struct overwritesC<Kernel, decltype(void(Kernel::overwritesC))> : std::integral_constant<bool, Kernel::overwritesC> {};
+
+// Goto/BLIS style blocking on top of a runner that provides gemmBlock(). The loops are, from the outside in:
+//   NC columns of C: a KC x NC panel of the reordered B stays in L3
+//   KC of the width: C is accumulated one KC slice at a time
+//   MC rows of A: an MC x KC block of A stays in L2 and is reused for every column block of the panel
+// and gemmBlock then walks the tiles, reusing one KC x numregs sliver of B from L1 for all the row blocks of the MC block.
+// The reordered B keeps every column block contiguous along the width, so a KC slice is just an offset into it.
+// Block sizes of 0 are derived from the detected cache sizes, anything else overrides them.
+template<class Runner, size_t KC = 0, size_t MC = 0, size_t NC = 0>
+struct blocked {
+  typedef typename Runner::gemm Kernel;
+  static_assert(!overwritesC<Kernel>::value, "blocked<> accumulates C one KC slice at a time, which needs a kernel that does C += A*B");
+
+  struct BlockSizes {
+    size_t kc;
+    size_t mc;
+    size_t nc;
+  };
+
+  static BlockSizes deriveBlockSizes(const CacheSizes &caches) {
+    const size_t regwidth = Kernel::regwidth;
+    const size_t numregs = Kernel::numregs;
+    BlockSizes sizes;
+    // A numregs x KC sliver of A and of B share half of L1, the other half is for C and whatever else is going on
+    sizes.kc = KC ? KC : std::max(regwidth, (caches.l1/(4*numregs))/regwidth*regwidth);
+    // The MC x KC block of A takes half of L2
+    sizes.mc = MC ? MC : std::max(numregs, (caches.l2/(2*sizes.kc))/numregs*numregs);
+    // The KC x NC panel of B takes half of L3
+    sizes.nc = NC ? NC : std::max(numregs, (caches.l3/(2*sizes.kc))/numregs*numregs);
+    return sizes;
+  }
+
+  static const BlockSizes &blockSizes() {
+    static const BlockSizes sizes = deriveBlockSizes(detectCacheSizes());
+    return sizes;
+  }
+
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    const BlockSizes &sizes = blockSizes();
+    for (size_t jc = 0; jc < colsB; jc += sizes.nc) {
+      const size_t jcEnd = std::min(jc + sizes.nc, colsB);
+      for (size_t kc = 0; kc < width; kc += sizes.kc) {
+        const size_t kcEnd = std::min(kc + sizes.kc, width);
+        for (size_t ic = 0; ic < rowsA; ic += sizes.mc) {
+          const size_t icEnd = std::min(ic + sizes.mc, rowsA);
+          Kernel::gemmBlock(A, B, C, width, colsB, ic, icEnd, jc, jcEnd, kc, kcEnd);
+        }
+      }
+    }
+  }
+
+  struct runner {
+    using gemm = bftile::blocked<Runner, KC, MC, NC>;
+    using prepareB = typename Runner::prepareB;
+  };
+};
+
+} // namespace bftile
@@ -1,8 +1,23 @@
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <memory>
+#include <vector>
 #include "aligned.h"
 #include "mm128.h"
 #include "mm256.h"
 #include "mm512.h"
+#include "maddubs.h"
+#include "avxvnni.h"
+#include "parallel.h"
+#include "blocked.h"
+#include "batched.h"
+#include "fixed.h"
+#include "accumulate.h"
+#include "epilogue.h"
+#include "dispatch.h"
+#include "perf.h"
+#include "serialize.h"
 #include "utils.h"
 #include "do_not_optimize.h"
 
@@ -133,7 +148,7 @@ bool mm512Example(bool toprint=false) {
   __m512i * breord = reinterpret_cast<__m512i*>(aligned_alloc(64*16*sizeof(int8_t), 1024));
 
   // Populate
-  for (int i = 0; i<2048; i++) {
+  for (int i = 0; i<64*16; i++) {
     reinterpret_cast<int8_t*>(amat)[i] = (int8_t)(i%127); // A needs to be unsigned for the UBS operation, so in order to get the same results as slow gemm, make sure it fits
     reinterpret_cast<int8_t*>(bmat)[i] = (int8_t)(i%255); // We have unsigned times signed so one will be 0-255 other will be -128-127
   }
@@ -186,7 +201,7 @@ double GEMMTest(bftile::matrix dims, bool toprint=false) {
   AlignedVector<uint8_t> A(aRows*width);
   AlignedVector<int8_t> B(width*bCols);
   AlignedVector<int8_t> BColM(width*bCols);
-  AlignedVector<int8_t> BReord(width*bCols);
+  AlignedVector<int8_t> BReord(gemmNS::prepareB::preparedSize(width, bCols));
   AlignedVector<int8_t> BReordColM(width*bCols);
   AlignedVector<int32_t> Cslow(aRows*bCols);
   AlignedVector<int32_t> Cfast(aRows*bCols);
@@ -237,8 +252,70 @@ double GEMMTest(bftile::matrix dims, bool toprint=false) {
   return elapsed_seconds.count();
 }
 
+// A packed once with prepareAMatrix and multiplied with gemmPacked has to give the same result as gemm, which packs as it goes
+template<class packedNS>
+bool packedATest(bftile::matrix dims) {
+  using namespace bftile;
+  size_t aRows = dims.aRows;
+  size_t width = dims.width;
+  size_t bCols = dims.bCols;
+
+  AlignedVector<uint8_t> A(aRows*width);
+  AlignedVector<uint8_t> APacked(packedNS::packedSize(aRows, width));
+  AlignedVector<int8_t> B(width*bCols);
+  AlignedVector<int8_t> BReord(packedNS::runner::prepareB::preparedSize(width, bCols));
+  AlignedVector<int32_t> Cslow(aRows*bCols);
+  AlignedVector<int32_t> Cpacked(aRows*bCols);
+
+  for (size_t i = 0; i < aRows*width; i++) {
+    A[i] = i % 255;
+  }
+  for (size_t i = 0; i < width*bCols; i++) {
+    B[i] = i % 255;
+  }
+  for (auto&& item : Cslow) {
+    item = 0;
+  }
+  for (auto&& item : Cpacked) {
+    item = 0;
+  }
+
+  packedNS::runner::prepareB::prepareBMatrix(B.begin(), BReord.begin(), width, bCols);
+  packedNS::prepareAMatrix(A.begin(), APacked.begin(), aRows, width);
+  gemmRowMColM(A.begin(), B.begin(), aRows, width, bCols, Cslow.begin());
+  packedNS::gemmPacked(APacked.begin(), BReord.begin(), Cpacked.begin(), aRows, width, bCols);
+
+  bool wrong = std::memcmp(Cpacked.begin(), Cslow.begin(), aRows*bCols*sizeof(int32_t)) != 0;
+  if (wrong) {
+    printMat(Cslow.begin(), aRows, bCols, "A * BcolM SlowMult", 8);
+    printMat(Cpacked.begin(), aRows, bCols, "Packed A * B", 8);
+    std::cerr << "Packed A gemm and slow gemm implementations differ" << std::endl;
+  }
+
+  // The same bytes of A read as signed, packed with the shift
+  AlignedVector<int32_t> correction(bCols);
+  const int8_t * ASigned = reinterpret_cast<const int8_t *>(A.begin());
+  for (auto&& item : Cslow) {
+    item = 0;
+  }
+  for (auto&& item : Cpacked) {
+    item = 0;
+  }
+  packedNS::runner::prepareB::prepareBMatrix(B.begin(), BReord.begin(), correction.begin(), width, bCols);
+  packedNS::prepareAMatrix(A.begin(), APacked.begin(), aRows, width, true);
+  gemmRowMColM(ASigned, B.begin(), aRows, width, bCols, Cslow.begin());
+  packedNS::gemmPacked(APacked.begin(), BReord.begin(), aRows, width, bCols, shiftedA(correction.begin(), AccumulateC(Cpacked.begin(), bCols)));
+  if (std::memcmp(Cpacked.begin(), Cslow.begin(), aRows*bCols*sizeof(int32_t))) {
+    wrong = true;
+    std::cerr << "Signed packed A gemm and slow gemm implementations differ" << std::endl;
+  }
+  return wrong;
+}
+
+// The fused epilogues against the int32 product scaled, biased and clamped one element at a time. Float output gets per column
+// scales, a bias and a ReLU, int8 output gets a per tensor scale and a clamp that is narrower than what saturation would do.
 template<class gemmNS>
-double gemmBenchmark(bftile::matrix dims) {
+bool epilogueTest(bftile::matrix dims) {
   using namespace bftile;
   size_t aRows = dims.aRows;
   size_t width = dims.width;
@@ -246,8 +323,12 @@ double gemmBenchmark(bftile::matrix dims) {
 
   AlignedVector<uint8_t> A(aRows*width);
   AlignedVector<int8_t> B(width*bCols);
-  AlignedVector<int8_t> BReord(width*bCols);
-  AlignedVector<int32_t> Cfast(aRows*bCols);
+  AlignedVector<int8_t> BReord(gemmNS::prepareB::preparedSize(width, bCols));
+  AlignedVector<int32_t> Cslow(aRows*bCols);
+  AlignedVector<float> Cfloat(aRows*bCols);
+  AlignedVector<int8_t> Cint8(aRows*bCols);
+  AlignedVector<float> scales(bCols);
+  AlignedVector<float> bias(bCols);
 
   for (size_t i = 0; i < aRows*width; i++) {
     A[i] = i % 255;
@@ -255,64 +336,295 @@ double gemmBenchmark(bftile::matrix dims) {
   for (size_t i = 0; i < width*bCols; i++) {
     B[i] = i % 255;
   }
-  for (auto&& item : Cfast) {
+  for (auto&& item : Cslow) {
     item = 0;
   }
+  for (size_t j = 0; j < bCols; j++) {
+    scales[j] = 0.001f*(j % 7 + 1);
+    bias[j] = j % 2 ? 50.0f*j : -50.0f*j;
+  }
+  const float tensorScale = 1.0f/((float)width*64);
 
-  // Prepare datapoints
   gemmNS::prepareB::prepareBMatrix(B.begin(), BReord.begin(), width, bCols);
+  gemmRowMColM(A.begin(), B.begin(), aRows, width, bCols, Cslow.begin());
+  gemmNS::gemm::gemm(A.begin(), BReord.begin(), aRows, width, bCols, Dequantize<float>(Cfloat.begin(), bCols, scales.begin(), true, bias.begin(), 0.0f));
+  gemmNS::gemm::gemm(A.begin(), BReord.begin(), aRows, width, bCols, Dequantize<int8_t>(Cint8.begin(), bCols, &tensorScale, false, nullptr, -100.0f, 100.0f));
 
-  auto start = std::chrono::steady_clock::now();
+  bool wrong = false;
+  for (size_t i = 0; i < aRows; i++) {
+    for (size_t j = 0; j < bCols; j++) {
+      float expectedFloat = std::max(std::fma((float)Cslow[i*bCols + j], scales[j], bias[j]), 0.0f);
+      float expectedInt8 = std::nearbyint(std::min(std::max((float)Cslow[i*bCols + j]*tensorScale, -100.0f), 100.0f));
+      if (Cfloat[i*bCols + j] != expectedFloat || Cint8[i*bCols + j] != (int8_t)expectedInt8) {
+        wrong = true;
+      }
+    }
+  }
+  if (wrong) {
+    printMat(Cslow.begin(), aRows, bCols, "A * BcolM SlowMult", 8);
+    printMat(Cint8.begin(), aRows, bCols, "A * B int8 epilogue", 4);
+    std::cerr << "Epilogue and slow gemm implementations differ" << std::endl;
+  }
+  return wrong;
+}
+
+// Signed A through the +128 shift and the column sum correction, over the whole int8 range including -128 and 127
+template<class gemmNS>
+bool signedATest(bftile::matrix dims) {
+  using namespace bftile;
+  size_t aRows = dims.aRows;
+  size_t width = dims.width;
+  size_t bCols = dims.bCols;
+
+  AlignedVector<int8_t> A(aRows*width);
+  AlignedVector<int8_t> B(width*bCols);
+  AlignedVector<int8_t> BReord(gemmNS::prepareB::preparedSize(width, bCols));
+  AlignedVector<int32_t> correction(bCols);
+  AlignedVector<int32_t> Cslow(aRows*bCols);
+  AlignedVector<int32_t> Cfast(aRows*bCols);
+
+  for (size_t i = 0; i < aRows*width; i++) {
+    A[i] = (int)((i*37) % 256) - 128;
+  }
+  for (size_t i = 0; i < width*bCols; i++) {
+    B[i] = i % 255;
+  }
+  for (auto&& item : Cslow) {
+    item = 0;
+  }
+  for (auto&& item : Cfast) {
+    item = 0;
+  }
+
+  gemmNS::prepareB::prepareBMatrix(B.begin(), BReord.begin(), correction.begin(), width, bCols);
+  gemmRowMColM(A.begin(), B.begin(), aRows, width, bCols, Cslow.begin());
+  gemmNS::gemm::gemm(reinterpret_cast<const uint8_t *>(A.begin()), BReord.begin(), aRows, width, bCols,
+                     shiftedA(correction.begin(), AccumulateC(Cfast.begin(), bCols)));
+
+  bool wrong = std::memcmp(Cfast.begin(), Cslow.begin(), aRows*bCols*sizeof(int32_t)) != 0;
+  if (wrong) {
+    printMat(A.begin(), aRows, width, "A int8", 4);
+    printMat(Cslow.begin(), aRows, bCols, "A * BcolM SlowMult", 8);
+    printMat(Cfast.begin(), aRows, bCols, "Signed A * B fast", 8);
+    std::cerr << "Signed A gemm and slow gemm implementations differ" << std::endl;
+  }
+  return wrong;
+}
+
+// A running sum that leaves the int32 range half way through the width and comes back into it by the end. Only NonSaturating
+// accumulation gets this right, Saturating clips at INT32_MAX on the way up.
+template<class gemmNS>
+bool overflowTest(size_t aRows, size_t width, size_t bCols) {
+  using namespace bftile;
+  AlignedVector<uint8_t> A(aRows*width);
+  AlignedVector<int8_t> B(width*bCols);
+  AlignedVector<int8_t> BReord(gemmNS::prepareB::preparedSize(width, bCols));
+  AlignedVector<int32_t> Cfast(aRows*bCols);
+
+  for (auto&& item : A) {
+    item = 255;
+  }
+  for (size_t j = 0; j < bCols; j++) {
+    for (size_t w = 0; w < width; w++) {
+      B[j*width + w] = w < width/2 ? 127 : -128;
+    }
+  }
+  for (auto&& item : Cfast) {
+    item = 0;
+  }
+  gemmNS::prepareB::prepareBMatrix(B.begin(), BReord.begin(), width, bCols);
   gemmNS::gemm::gemm(A.begin(), BReord.begin(), Cfast.begin(), aRows, width, bCols);
-  auto end = std::chrono::steady_clock::now();
 
-  doNotOptimizeAway(Cfast.begin());
-  std::chrono::duration<double> elapsed_seconds = end-start;
-  return elapsed_seconds.count();
+  const int64_t expected = 255*(127*(int64_t)(width/2) - 128*(int64_t)(width - width/2));
+  bool wrong = false;
+  for (auto&& item : Cfast) {
+    if (item != expected) {
+      wrong = true;
+    }
+  }
+  if (wrong) {
+    std::cerr << "Non saturating gemm overflowed: expected " << expected << " got " << Cfast[0] << std::endl;
+  }
+  return wrong;
+}
+
+// Preparing B on several threads has to give exactly the same bytes as preparing it on one. Big sizes also take the streaming
+// store path (see streamPrepared).
+template<class gemmNS>
+bool parallelPrepareTest(size_t rowsB, size_t colsB, size_t threads) {
+  using namespace bftile;
+  typedef typename gemmNS::prepareB Serial;
+  typedef typename parallel<gemmNS>::prepareB Parallel;
+  AlignedVector<int8_t> B(rowsB*colsB);
+  AlignedVector<int8_t> serial(Serial::preparedSize(rowsB, colsB));
+  AlignedVector<int8_t> threaded(Parallel::preparedSize(rowsB, colsB));
+
+  for (size_t i = 0; i < rowsB*colsB; i++) {
+    B[i] = i % 255;
+  }
+  ThreadPool pool(threads);
+  Serial::prepareBMatrix(B.begin(), serial.begin(), rowsB, colsB);
+  Parallel::prepareBMatrix(B.begin(), threaded.begin(), rowsB, colsB, pool);
+
+  bool wrong = !std::equal(serial.begin(), serial.end(), threaded.begin());
+  if (wrong) {
+    std::cerr << "Parallel and serial prepareBMatrix differ for " << rowsB << "x" << colsB << " on " << threads << " threads" << std::endl;
+  }
+  return wrong;
+}
+
+// The kernels that run without AVX512VNNI (see maddubs.h and avxvnni.h) have to prepare B byte for byte like the VNNI kernel
+// family they mirror, ragged edges and streaming stores included
+template<class gemmNS, class referenceNS>
+bool sameLayoutTest(size_t rowsB, size_t colsB) {
+  using namespace bftile;
+  typedef typename gemmNS::prepareB Prepare;
+  typedef typename referenceNS::prepareB Reference;
+  AlignedVector<int8_t> B(rowsB*colsB);
+  AlignedVector<int8_t> prepared(Prepare::preparedSize(rowsB, colsB));
+  AlignedVector<int8_t> expected(Reference::preparedSize(rowsB, colsB));
+
+  for (size_t i = 0; i < rowsB*colsB; i++) {
+    B[i] = i % 255;
+  }
+  Prepare::prepareBMatrix(B.begin(), prepared.begin(), rowsB, colsB);
+  Reference::prepareBMatrix(B.begin(), expected.begin(), rowsB, colsB);
+
+  bool wrong = prepared.size() != expected.size() || !std::equal(prepared.begin(), prepared.end(), expected.begin());
+  if (wrong) {
+    std::cerr << "Fallback and VNNI prepareBMatrix differ for " << rowsB << "x" << colsB << std::endl;
+  }
+  return wrong;
+}
+
+// A B written to disk and mapped back has to multiply to the same C as a B prepared in memory, with and without the
+// correction for a signed A. Mapping it as the wrong layout or register width has to throw.
+template<class gemmNS>
+bool serializeTest(bftile::matrix dims) {
+  using namespace bftile;
+  typedef typename gemmNS::prepareB Prepare;
+  size_t aRows = dims.aRows;
+  size_t width = dims.width;
+  size_t bCols = dims.bCols;
+
+  AlignedVector<int8_t> A(aRows*width);
+  AlignedVector<int8_t> B(width*bCols);
+  AlignedVector<int32_t> Cslow(aRows*bCols);
+  AlignedVector<int32_t> Cfast(aRows*bCols);
+  for (size_t i = 0; i < aRows*width; i++) {
+    A[i] = (int)((i*37) % 256) - 128;
+  }
+  for (size_t i = 0; i < width*bCols; i++) {
+    B[i] = i % 255;
+  }
+  for (auto&& item : Cslow) {
+    item = 0;
+  }
+  for (auto&& item : Cfast) {
+    item = 0;
+  }
+  gemmRowMColM(A.begin(), B.begin(), aRows, width, bCols, Cslow.begin());
+
+  char path[] = "/tmp/bftileXXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    std::cerr << "Can't create a temporary file for the serialization test" << std::endl;
+    return true;
+  }
+  close(fd);
+  bool wrong = false;
+  try {
+    writePrepared<Prepare>(path, B.begin(), width, bCols, 0.5f, true);
+    MappedPrepared mapped(path);
+    wrong = mapped.rowsB() != width || mapped.colsB() != bCols || mapped.scale() != 0.5f
+      || reinterpret_cast<uintptr_t>(mapped.data()) % sizeof(typename gemmNS::gemm::Register) != 0;
+    gemmNS::gemm::gemm(reinterpret_cast<const uint8_t *>(A.begin()), mapped.data<Prepare>(), aRows, width, bCols,
+                       shiftedA(mapped.correction(), AccumulateC(Cfast.begin(), bCols)));
+    bool threw = false;
+    try {
+      mapped.data<depthfirst>();
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    wrong = wrong || !threw;
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    wrong = true;
+  }
+  unlink(path);
+
+  wrong = wrong || !std::equal(Cslow.begin(), Cslow.end(), Cfast.begin());
+  if (wrong) {
+    std::cerr << "Mapped prepared B gemm and slow gemm implementations differ" << std::endl;
+  }
+  return wrong;
 }
 
-void benchmark(size_t times=100) {
-  double time_rows = 0;
-  double time_width = 0;
-  double time_width_addr = 0;
-  double time_width_addr_loop = 0;
-  double time_width_addr_loop_tile_loop = 0;
-  double time_width_addr_loop_tile_loop_write_dep = 0;
-  double time_width_addr_loop_tile_loop_write_dep_mm256 = 0;
-  double time_width_addr_loop_tile_loop_write_dep_mm512 = 0;
-  bftile::matrix matrices[11] = {{16, 64, 16},
-                                 {16, 256, 256},
-                                 {16, 2048, 256},
-                                 {320, 256, 256},
-                                 {480, 256, 256},
-                                 {240, 256, 256},
-                                 {208, 256, 256},
-                                 {256, 256, 256},
-                                 {1024, 1024, 1024},
-                                 {4096, 4096, 128},
-                                 {640, 320, 320}};
-  for (size_t i = 0; i<times; i++) {
-    for (auto&& matrix : matrices) {
-      time_rows += gemmBenchmark<bftile::breadthfirst::runner>(matrix);
-      time_width += gemmBenchmark<bftile::depthfirst::runner>(matrix);
-      time_width_addr += gemmBenchmark<bftile::depthfirstaddr::runner>(matrix);
-      time_width_addr_loop += gemmBenchmark<bftile::depthfirstaddrloop::runner>(matrix);
-      time_width_addr_loop_tile_loop += gemmBenchmark<bftile::depthfirstaddrlooptileloop::runner>(matrix);
-      time_width_addr_loop_tile_loop_write_dep += gemmBenchmark<bftile::depthfirstaddrlooptileloopwritedepend::runner>(matrix);
-      time_width_addr_loop_tile_loop_write_dep_mm256 += gemmBenchmark<bftile::mm256::depthfirstaddrlooptileloopwritedepend::runner>(matrix);
-      time_width_addr_loop_tile_loop_write_dep_mm512 += gemmBenchmark<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner>(matrix);
+// A batch of problems of the given shapes, every third of them with its own B and the rest sharing one B per shape, has to
+// come out the same as multiplying them one at a time
+template<class gemmNS>
+bool batchedTest(const bftile::matrix * shapes, size_t shapeCount, size_t count, size_t threads) {
+  using namespace bftile;
+  std::vector<std::unique_ptr<AlignedVector<uint8_t>>> As;
+  std::vector<std::unique_ptr<AlignedVector<int8_t>>> Bs;
+  std::vector<std::unique_ptr<AlignedVector<int8_t>>> BReords;
+  std::vector<std::unique_ptr<AlignedVector<int32_t>>> Cslows;
+  std::vector<std::unique_ptr<AlignedVector<int32_t>>> Cfasts;
+  std::vector<GemmProblem> problems;
+  std::vector<size_t> shared(shapeCount, count); // Which problem owns the shared B of every shape
+  for (size_t i = 0; i < count; i++) {
+    const matrix &dims = shapes[i % shapeCount];
+    As.emplace_back(new AlignedVector<uint8_t>(dims.aRows*dims.width));
+    Cslows.emplace_back(new AlignedVector<int32_t>(dims.aRows*dims.bCols));
+    Cfasts.emplace_back(new AlignedVector<int32_t>(dims.aRows*dims.bCols));
+    for (size_t k = 0; k < dims.aRows*dims.width; k++) {
+      (*As[i])[k] = (k*7 + i) % 255;
+    }
+    for (size_t k = 0; k < dims.aRows*dims.bCols; k++) {
+      (*Cslows[i])[k] = 0;
+      (*Cfasts[i])[k] = 0;
+    }
+    size_t owner = i;
+    if (i % 3 && shared[i % shapeCount] < count) {
+      owner = shared[i % shapeCount];
+    } else if (i % 3) {
+      shared[i % shapeCount] = i;
     }
+    Bs.emplace_back(new AlignedVector<int8_t>(dims.width*dims.bCols));
+    BReords.emplace_back(new AlignedVector<int8_t>(gemmNS::prepareB::preparedSize(dims.width, dims.bCols)));
+    if (owner == i) {
+      for (size_t k = 0; k < dims.width*dims.bCols; k++) {
+        (*Bs[i])[k] = (k*3 + i) % 255;
+      }
+      gemmNS::prepareB::prepareBMatrix(Bs[i]->begin(), BReords[i]->begin(), dims.width, dims.bCols);
+    } else {
+      std::copy(Bs[owner]->begin(), Bs[owner]->end(), Bs[i]->begin());
+    }
+    gemmRowMColM(As[i]->begin(), Bs[i]->begin(), dims.aRows, dims.width, dims.bCols, Cslows[i]->begin());
+    problems.push_back({As[i]->begin(), BReords[owner]->begin(), Cfasts[i]->begin(), dims.aRows, dims.width, dims.bCols});
   }
-  std::cerr << "mm128 Iteration over rows-of-a took: " << time_rows << " seconds." << std::endl;
-  std::cerr << "mm128 Iteration over width took: " << time_width << " seconds." << std::endl;
-  std::cerr << "mm128 Iteration over width with addresses took: " << time_width_addr << " seconds." << std::endl;
-  std::cerr << "mm128 Iteration over width with addresses assigned via for loop took: " << time_width_addr_loop << " seconds." << std::endl;
-  std::cerr << "mm128 Iteration over width with addresses assigned via for loop, for loop tile took: " << time_width_addr_loop_tile_loop << " seconds." << std::endl;
-  std::cerr << "mm128 Iteration over width with addresses assigned via for loop, for loop tile with write dependencies took: " << time_width_addr_loop_tile_loop_write_dep << " seconds." << std::endl;
-  std::cerr << "mm256 Iteration over width with addresses assigned via for loop, for loop tile with write dependencies took: " << time_width_addr_loop_tile_loop_write_dep_mm256 << " seconds." << std::endl;
-  std::cerr << "mm256 Iteration over width with addresses assigned via for loop, for loop tile with write dependencies took: " << time_width_addr_loop_tile_loop_write_dep_mm512 << " seconds." << std::endl;
+
+  ThreadPool pool(threads);
+  batched<gemmNS>::gemm(problems.data(), problems.size(), pool);
+
+  bool wrong = false;
+  for (size_t i = 0; i < count; i++) {
+    if (!std::equal(Cslows[i]->begin(), Cslows[i]->end(), Cfasts[i]->begin())) {
+      wrong = true;
+    }
+  }
+  if (wrong) {
+    std::cerr << "Batched gemm and slow gemm implementations differ for a batch of " << count << " on " << threads << " threads" << std::endl;
+  }
+  return wrong;
 }
 
+// Fixed shapes for the tests, everything else takes the generic loops
+typedef bftile::fixedShapes<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner, bftile::Shape<64, 16>, bftile::Shape<128, 32>,
+                            bftile::Shape<192, 48>, bftile::Shape<128, 128>, bftile::Shape<320, 144>, bftile::Shape<64, 80>> mm512Fixed;
+typedef bftile::fixedShapes<bftile::mm256::depthfirstaddrlooptileloopwritedepend::runner, bftile::Shape<64, 16>, bftile::Shape<96, 48>> mm256Fixed;
+typedef bftile::fixedShapes<bftile::depthfirstaddrlooptileloopwritedepend::runner, bftile::Shape<32, 8>, bftile::Shape<16, 12>> mm128Fixed;
+
 int main() {
   mm128Example();
   mm256Example();
@@ -338,6 +650,11 @@ int main() {
     GEMMTest<bftile::depthfirstaddrloop::runner>(matrix);
     GEMMTest<bftile::depthfirstaddrlooptileloop::runner>(matrix);
     GEMMTest<bftile::depthfirstaddrlooptileloopwritedepend::runner>(matrix);
+    GEMMTest<bftile::depthfirstaddrlooptileloopwritedependWith<bftile::NonSaturating>::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::depthfirstaddrlooptileloopwritedepend::runner>::runner>(matrix);
+    GEMMTest<mm128Fixed::runner>(matrix);
+    GEMMTest<bftile::registeraccumulated<>::runner>(matrix);
+    GEMMTest<bftile::registeraccumulated<2, bftile::NonSaturating>::runner>(matrix);
   }
 
   bftile::matrix matricesmm256[14] = {{8, 32, 8},
@@ -356,6 +673,11 @@ int main() {
                                  {40, 512, 512}};
   for (auto&& matrix : matricesmm256) {
     GEMMTest<bftile::mm256::depthfirstaddrlooptileloopwritedepend::runner>(matrix);
+    GEMMTest<bftile::mm256::depthfirstaddrlooptileloopwritedependWith<bftile::NonSaturating>::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::mm256::depthfirstaddrlooptileloopwritedepend::runner>::runner>(matrix);
+    GEMMTest<mm256Fixed::runner>(matrix);
+    GEMMTest<bftile::mm256::registeraccumulated<>::runner>(matrix);
+    GEMMTest<bftile::mm256::registeraccumulated<4>::runner>(matrix);
   }
 
   bftile::matrix matricesmm512[14] = {{16, 64, 16},
@@ -374,6 +696,121 @@ int main() {
                                  {48, 512, 512}};
   for (auto&& matrix : matricesmm512) {
     GEMMTest<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner>::runner>(matrix);
+    GEMMTest<bftile::mm512::registerblocked<1>::runner>(matrix);
+    GEMMTest<bftile::mm512::registerblocked<2>::runner>(matrix);
+    GEMMTest<bftile::mm512::registerblocked<3>::runner>(matrix);
+    GEMMTest<bftile::mm512::registerblocked<4>::runner>(matrix);
+    GEMMTest<bftile::mm512::registerblocked<2, bftile::NonSaturating>::runner>(matrix);
+    GEMMTest<bftile::mm512::depthfirstaddrlooptileloopwritedependWith<bftile::NonSaturating>::runner>(matrix);
+    GEMMTest<bftile::blocked<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner>::runner>(matrix);
+    GEMMTest<bftile::blocked<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner, 128, 32, 32>::runner>(matrix); // Small blocks to hit every boundary
+    GEMMTest<mm512Fixed::runner>(matrix);
+    GEMMTest<bftile::mm512::registeraccumulated<>::runner>(matrix);
+    GEMMTest<bftile::mm512::registeraccumulated<16>::runner>(matrix);
+    GEMMTest<bftile::mm512::registeraccumulated<4, bftile::NonSaturating>::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::mm512::registeraccumulated<>::runner>::runner>(matrix);
+    GEMMTest<bftile::blocked<bftile::mm512::registeraccumulated<>::runner, 128, 32, 32>::runner>(matrix);
+    GEMMTest<bftile::mm512::prefetched<0>::runner>(matrix);
+    GEMMTest<bftile::mm512::prefetched<2>::runner>(matrix);
+    GEMMTest<bftile::mm512::prefetched<4, true>::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::mm512::prefetched<2, true>::runner>::runner>(matrix);
+    GEMMTest<bftile::blocked<bftile::mm512::prefetched<2>::runner, 128, 32, 32>::runner>(matrix);
+  }
+  // Shapes that aren't multiples of anything, for the drivers that handle ragged edges
+  bftile::matrix matricesanyshape[12] = {{1, 1, 1},
+                                 {1, 64, 16},
+                                 {3, 70, 17},
+                                 {4, 16, 4},
+                                 {17, 129, 33},
+                                 {5, 300, 7},
+                                 {15, 63, 15},
+                                 {16, 65, 31},
+                                 {33, 1000, 50},
+                                 {640, 320, 320},
+                                 {72, 320, 144},
+                                 {100, 257, 3}};
+  for (auto&& matrix : matricesanyshape) {
+    GEMMTest<bftile::anyshape::runner>(matrix);
+    GEMMTest<bftile::mm256::anyshape::runner>(matrix);
+    GEMMTest<bftile::mm512::anyshape::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::mm512::anyshape::runner>::runner>(matrix);
+    GEMMTest<bftile::perf::instrumented<bftile::mm512::anyshape::runner>::runner>(matrix);
+    GEMMTest<bftile::blocked<bftile::anyshape::runner, 64, 8, 8>::runner>(matrix);
+    GEMMTest<bftile::blocked<bftile::mm512::anyshape::runner, 64, 16, 32>::runner>(matrix);
+    GEMMTest<bftile::avx2::anyshape::runner>(matrix);
+    GEMMTest<bftile::avxvnni::anyshape::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::avxvnni::anyshape::runner>::runner>(matrix);
+    GEMMTest<bftile::avx512bw::anyshape::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::avx512bw::anyshape::runner>::runner>(matrix);
+    GEMMTest<bftile::packedA::runner>(matrix);
+    GEMMTest<bftile::mm256::packedA::runner>(matrix);
+    GEMMTest<bftile::mm512::packedA::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::mm512::packedA::runner>::runner>(matrix);
+    GEMMTest<bftile::blocked<bftile::mm512::packedA::runner, 128, 16, 32>::runner>(matrix);
+    packedATest<bftile::packedA>(matrix);
+    packedATest<bftile::mm256::packedA>(matrix);
+    packedATest<bftile::mm512::packedA>(matrix);
+    epilogueTest<bftile::anyshape::runner>(matrix);
+    epilogueTest<bftile::mm256::anyshape::runner>(matrix);
+    epilogueTest<bftile::mm512::anyshape::runner>(matrix);
+    epilogueTest<bftile::parallel<bftile::mm512::anyshape::runner>::runner>(matrix);
+    epilogueTest<bftile::packedA::runner>(matrix);
+    epilogueTest<bftile::mm256::packedA::runner>(matrix);
+    epilogueTest<bftile::mm512::packedA::runner>(matrix);
+    signedATest<bftile::anyshape::runner>(matrix);
+    signedATest<bftile::mm256::anyshape::runner>(matrix);
+    signedATest<bftile::mm512::anyshape::runner>(matrix);
+    signedATest<bftile::parallel<bftile::mm512::anyshape::runner>::runner>(matrix);
+    signedATest<bftile::packedA::runner>(matrix);
+    signedATest<bftile::mm256::packedA::runner>(matrix);
+    signedATest<bftile::mm512::packedA::runner>(matrix);
+    GEMMTest<bftile::mm512::gemv::runner>(matrix);
+    GEMMTest<bftile::parallel<bftile::mm512::gemv::runner>::runner>(matrix);
+    GEMMTest<bftile::blocked<bftile::mm512::gemv::runner, 128, 16, 32>::runner>(matrix);
+    epilogueTest<bftile::mm512::gemv::runner>(matrix);
+    signedATest<bftile::mm512::gemv::runner>(matrix);
+    GEMMTest<bftile::anyshapeWith<bftile::NonSaturating>::runner>(matrix);
+    GEMMTest<bftile::mm256::anyshapeWith<bftile::NonSaturating>::runner>(matrix);
+    GEMMTest<bftile::mm512::anyshapeWith<bftile::NonSaturating>::runner>(matrix);
+    GEMMTest<bftile::mm512::packedAWith<bftile::NonSaturating>::runner>(matrix);
+  }
+  // 255*127*70000 is past INT32_MAX
+  overflowTest<bftile::anyshapeWith<bftile::NonSaturating>::runner>(3, 140001, 5);
+  overflowTest<bftile::mm256::anyshapeWith<bftile::NonSaturating>::runner>(3, 140001, 9);
+  overflowTest<bftile::mm512::anyshapeWith<bftile::NonSaturating>::runner>(3, 140001, 17);
+  overflowTest<bftile::packedAWith<bftile::NonSaturating>::runner>(3, 140001, 5);
+  overflowTest<bftile::mm256::packedAWith<bftile::NonSaturating>::runner>(3, 140001, 9);
+  overflowTest<bftile::mm512::packedAWith<bftile::NonSaturating>::runner>(3, 140001, 17);
+  overflowTest<bftile::avx2::anyshape::runner>(3, 140001, 9);
+  overflowTest<bftile::avxvnni::anyshapeWith<bftile::avxvnni::NonSaturating>::runner>(3, 140001, 9);
+  overflowTest<bftile::avx512bw::anyshape::runner>(3, 140001, 17);
+
+  for (auto&& matrix : matricesanyshape) {
+    serializeTest<bftile::mm256::anyshape::runner>(matrix);
+    serializeTest<bftile::mm512::anyshape::runner>(matrix);
+  }
+
+  parallelPrepareTest<bftile::anyshape::runner>(1000, 1000, 3);
+  parallelPrepareTest<bftile::mm256::anyshape::runner>(1000, 1000, 4);
+  parallelPrepareTest<bftile::mm512::anyshape::runner>(2048, 2100, 4);
+  parallelPrepareTest<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner>(2048, 2048, 4);
+  parallelPrepareTest<bftile::avx2::anyshape::runner>(1000, 1000, 4);
+
+  sameLayoutTest<bftile::avx2::anyshape::runner, bftile::mm256::anyshape::runner>(100, 13);
+  sameLayoutTest<bftile::avx2::anyshape::runner, bftile::mm256::anyshape::runner>(2048, 2100);
+  sameLayoutTest<bftile::avxvnni::anyshape::runner, bftile::mm256::depthfirstaddrlooptileloopwritedepend::runner>(2048, 2048);
+  sameLayoutTest<bftile::avx512bw::anyshape::runner, bftile::mm512::anyshape::runner>(100, 13);
+  sameLayoutTest<bftile::avx512bw::anyshape::runner, bftile::mm512::anyshape::runner>(2048, 2100);
+
+  batchedTest<bftile::mm512::anyshape::runner>(matricesanyshape, 12, 40, 1);
+  batchedTest<bftile::mm512::anyshape::runner>(matricesanyshape, 12, 40, 4);
+  batchedTest<bftile::mm256::packedA::runner>(matricesanyshape, 12, 25, 3);
+  batchedTest<bftile::anyshape::runner>(matricesanyshape, 12, 13, 2);
+
+  // Whatever the runtime dispatch picked for this CPU
+  std::cerr << "Runtime dispatch picked the " << bftile::backend().name << " backend." << std::endl;
+  for (auto&& matrix : matricesanyshape) {
+    GEMMTest<bftile::dispatched::runner>(matrix);
   }
-  benchmark(10);
 }
@@ -0,0 +1,88 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "dispatch.h"
+#include "utils.h"
+
+namespace bftile {
+namespace {
+
+size_t referencePreparedSize(size_t rowsB, size_t colsB) {
+  return rowsB*colsB;
+}
+
+void referencePrepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+  std::memcpy(out, in, rowsB*colsB); // Column major is what the reference gemm wants anyway
+}
+
+void referenceGemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+  gemmReference(A, B, C, rowsA, width, colsB);
+}
+
+bool alwaysSupported() {
+  return true;
+}
+
+// In order of preference, by instruction set only. mm256 and mm128 need the same AVX512VNNI as mm512, so they are not on
+// the list, see backend().
+const Backend * const candidates[] = {&backends::mm512, &backends::avxvnni, &backends::avx512bw, &backends::avx2, &backends::reference};
+
+// Everything BFTILE_BACKEND can name
+const Backend * const all[] = {&backends::mm512, &backends::mm256, &backends::mm128, &backends::avxvnni, &backends::avx512bw,
+                                &backends::avx2, &backends::reference};
+
+const Backend &select() {
+  if (const char *forced = std::getenv("BFTILE_BACKEND")) {
+    for (const Backend *candidate : all) {
+      if (!std::strcmp(candidate->name, forced)) {
+        if (candidate->supported()) {
+          return *candidate;
+        }
+        std::cerr << "BFTILE_BACKEND=" << forced << " is not supported by this CPU, choosing automatically." << std::endl;
+      }
+    }
+  }
+  for (const Backend *candidate : candidates) {
+    if (candidate->supported()) {
+      return *candidate;
+    }
+  }
+  return backends::reference;
+}
+
+} // namespace
+
+namespace cpu {
+bool avx512vnni() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")
+    && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("fma");
+}
+
+bool avxvnni() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("avxvnni");
+}
+
+bool avx512bw() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")
+    && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("fma");
+}
+
+bool avx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+} // namespace cpu
+
+namespace backends {
+const Backend reference = {"reference", alwaysSupported, 1, 1, 1, referencePreparedSize, referencePrepareBMatrix, referenceGemm};
+} // namespace backends
+
+const Backend &backend() {
+  static const Backend &chosen = select();
+  return chosen;
+}
+
+} // namespace bftile
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace bftile {
+/************************************************************************************ runtime dispatch ************************************************************************************/
+
+// One kernel family as seen by the dispatcher. Each family lives in its own translation unit (dispatch_mm*.cpp) so it can be
+// compiled for its own instruction set, independent of the flags of the rest of the build.
+struct Backend {
+  const char * name;
+  bool (*supported)(); // Does the CPU we're running on have the instructions this family needs
+  // Shape requirements of the family: rowsA, width and colsB need to be multiples of these. 1 means any shape goes.
+  size_t rowsMultiple;
+  size_t widthMultiple;
+  size_t colsMultiple;
+  // B comes in column major (rowsB == width). The reordered layout differs between families, so a B prepared by one
+  // family can only be used with the gemm of the same family.
+  size_t (*preparedSize)(size_t rowsB, size_t colsB); // Bytes needed for the reordered B
+  void (*prepareBMatrix)(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB);
+  void (*gemm)(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB);
+};
+
+namespace backends {
+extern const Backend mm512;
+extern const Backend mm256;
+extern const Backend mm128;
+extern const Backend avxvnni; // 256 bit VEX encoded VNNI, for the cores without AVX512
+extern const Backend avx512bw; // maddubs instead of dpbusds, see maddubs.h
+extern const Backend avx2;
+extern const Backend reference; // Plain C++, runs anywhere
+} // namespace backends
+
+// CPU feature checks matching the target blocks of targets.h
+namespace cpu {
+bool avx512vnni();
+bool avxvnni();
+bool avx512bw();
+bool avx2();
+} // namespace cpu
+
+// The backend the top level entry points are bound to. It is chosen once, on first use, as the first supported family in
+// order of preference: mm512, avxvnni, avx512bw, avx2, reference. The only criterion is the instruction set. mm256 and mm128
+// need the same AVX512VNNI as mm512, and nothing the CPU reports says when they would be faster, for example on small shapes
+// or on cores that clock down for 512 bit instructions. So they are never picked automatically. Setting BFTILE_BACKEND to the
+// name of any backend, those two included, forces that one instead, as long as the CPU supports it.
+const Backend &backend();
+
+// Top level entry points, forwarding to backend(). Shapes need to respect backend().rowsMultiple and friends.
+//
+// Every backend gives the same C for the same inputs: the exact sum, wrapped around to int32 where it leaves the int32 range,
+// like gemmReference. The VNNI backends use the NonSaturating policy of accumulate.h for that, since the maddubs fallbacks and
+// the plain C++ one can't saturate. Call a Saturating runner directly for clipping instead.
+inline size_t preparedSize(size_t rowsB, size_t colsB) {
+  return backend().preparedSize(rowsB, colsB);
+}
+
+inline void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+  backend().prepareBMatrix(in, out, rowsB, colsB);
+}
+
+inline void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+  /****** Important: C is assumed to be set to 0 ******/
+  backend().gemm(A, B, C, rowsA, width, colsB);
+}
+
+// The entry points above behind the runner interface used by the kernel headers
+struct dispatched {
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return bftile::preparedSize(rowsB, colsB);
+  }
+  static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    bftile::prepareBMatrix(in, out, rowsB, colsB);
+  }
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    bftile::gemm(A, B, C, rowsA, width, colsB);
+  }
+  struct runner {
+    using gemm = bftile::dispatched;
+    using prepareB = bftile::dispatched;
+  };
+};
+
+} // namespace bftile
@@ -0,0 +1,14 @@
+// The avx2 fallback family for CPUs without VNNI (see maddubs.h), compiled on its own so its target attributes don't leak into
+// the rest of the build
+#include "dispatch.h"
+#include "maddubs.h"
+#include "parallel.h"
+
+namespace bftile {
+namespace backends {
+const Backend avx2 = {"avx2", cpu::avx2, 1, 1, 1,
+                     avx2::anyshape::preparedSize,
+                     parallel<avx2::anyshape::runner>::prepareB::prepareBMatrix,
+                     parallel<avx2::anyshape::runner>::gemm};
+} // namespace backends
+} // namespace bftile
@@ -0,0 +1,14 @@
+// The avx512bw fallback family for CPUs without VNNI (see maddubs.h), compiled on its own so its target attributes don't leak into
+// the rest of the build
+#include "dispatch.h"
+#include "maddubs.h"
+#include "parallel.h"
+
+namespace bftile {
+namespace backends {
+const Backend avx512bw = {"avx512bw", cpu::avx512bw, 1, 1, 1,
+                         avx512bw::anyshape::preparedSize,
+                         parallel<avx512bw::anyshape::runner>::prepareB::prepareBMatrix,
+                         parallel<avx512bw::anyshape::runner>::gemm};
+} // namespace backends
+} // namespace bftile
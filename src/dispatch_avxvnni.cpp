@@ -0,0 +1,14 @@
+// The AVX-VNNI kernel family for CPUs with VNNI but without AVX512 (see avxvnni.h), compiled on its own so its target
+// attributes don't leak into the rest of the build
+#include "dispatch.h"
+#include "avxvnni.h"
+#include "parallel.h"
+
+namespace bftile {
+namespace backends {
+const Backend avxvnni = {"avxvnni", cpu::avxvnni, 1, 1, 1,
+                         avxvnni::anyshapeWith<avxvnni::NonSaturating>::preparedSize,
+                         parallel<avxvnni::anyshapeWith<avxvnni::NonSaturating>::runner>::prepareB::prepareBMatrix,
+                         parallel<avxvnni::anyshapeWith<avxvnni::NonSaturating>::runner>::gemm};
+} // namespace backends
+} // namespace bftile
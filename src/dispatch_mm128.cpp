@@ -0,0 +1,13 @@
+// The mm128 kernel family, compiled on its own so its target attributes don't leak into the rest of the build
+#include "dispatch.h"
+#include "mm128.h"
+#include "parallel.h"
+
+namespace bftile {
+namespace backends {
+const Backend mm128 = {"mm128", cpu::avx512vnni, 1, 1, 1,
+                      anyshapeWith<NonSaturating>::preparedSize,
+                      parallel<anyshapeWith<NonSaturating>::runner>::prepareB::prepareBMatrix,
+                      parallel<anyshapeWith<NonSaturating>::runner>::gemm};
+} // namespace backends
+} // namespace bftile
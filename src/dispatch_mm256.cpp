@@ -0,0 +1,13 @@
+// The mm256 kernel family, compiled on its own so its target attributes don't leak into the rest of the build
+#include "dispatch.h"
+#include "mm256.h"
+#include "parallel.h"
+
+namespace bftile {
+namespace backends {
+const Backend mm256 = {"mm256", cpu::avx512vnni, 1, 1, 1,
+                      mm256::anyshapeWith<NonSaturating>::preparedSize,
+                      parallel<mm256::anyshapeWith<NonSaturating>::runner>::prepareB::prepareBMatrix,
+                      parallel<mm256::anyshapeWith<NonSaturating>::runner>::gemm};
+} // namespace backends
+} // namespace bftile
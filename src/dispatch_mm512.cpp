@@ -0,0 +1,13 @@
+// The mm512 kernel family, compiled on its own so its target attributes don't leak into the rest of the build
+#include "dispatch.h"
+#include "mm512.h"
+#include "parallel.h"
+
+namespace bftile {
+namespace backends {
+const Backend mm512 = {"mm512", cpu::avx512vnni, 1, 1, 1,
+                      mm512::anyshapeWith<NonSaturating>::preparedSize,
+                      parallel<mm512::anyshapeWith<NonSaturating>::runner>::prepareB::prepareBMatrix,
+                      parallel<mm512::anyshapeWith<NonSaturating>::runner>::gemm};
+} // namespace backends
+} // namespace bftile
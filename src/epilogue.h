@@ -0,0 +1,196 @@
+#pragma once
+#include <immintrin.h>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include "targets.h"
+
+BFTILE_TARGET_AVX512VNNI_BEGIN
+
+namespace bftile {
+/************************************************************************************ epilogues ************************************************************************************/
+// An epilogue decides what happens to a row of a C tile before and after it is accumulated in a register. Drivers that take one
+// call, for every row of every C tile they compute:
+//   epilogue.init(acc, row, col, mask)   to set up the accumulator before the first multiply-add
+//   epilogue.finish(acc, row, col, mask) once the accumulator holds the sum over the range of the width it was given
+// row and col are the position of the first element of the register in C, mask selects the columns that exist at the ragged
+// right edge. This lets scaling, bias and activations happen while the tile is still in registers instead of in a second pass
+// that rereads all of C. Only AccumulateC makes sense on a driver that splits the width (blocked<> with a KC below the width),
+// the others need to see the full sum.
+// Epilogues also say whether A is signed (shiftA, see ShiftedA), since that changes how the drivers load A.
+
+// The float and int side of one register width, so that the epilogues can be written once for all of them. These are overloads
+// on the register type, like the dot() of accumulate.h. The ones that produce a register without taking one write it to out.
+inline void setZero(__m128i &out) { out = _mm_setzero_si128(); }
+inline void setZero(__m256i &out) { out = _mm256_setzero_si256(); }
+inline void setZero(__m512i &out) { out = _mm512_setzero_si512(); }
+
+inline __m128i add(__m128i a, __m128i b) { return _mm_add_epi32(a, b); }
+inline __m256i add(__m256i a, __m256i b) { return _mm256_add_epi32(a, b); }
+inline __m512i add(__m512i a, __m512i b) { return _mm512_add_epi32(a, b); }
+
+// int8 + 128 as uint8
+inline __m128i flipSign(__m128i a) { return _mm_xor_si128(a, _mm_set1_epi8(-128)); }
+inline __m256i flipSign(__m256i a) { return _mm256_xor_si256(a, _mm256_set1_epi8(-128)); }
+inline __m512i flipSign(__m512i a) { return _mm512_xor_si512(a, _mm512_set1_epi8(-128)); }
+
+inline void load(__m128i &out, __mmask8 mask, const int32_t * in) { out = _mm_maskz_loadu_epi32(mask, in); }
+inline void load(__m256i &out, __mmask8 mask, const int32_t * in) { out = _mm256_maskz_loadu_epi32(mask, in); }
+inline void load(__m512i &out, __mmask16 mask, const int32_t * in) { out = _mm512_maskz_loadu_epi32(mask, in); }
+inline void load(__m128 &out, __mmask8 mask, const float * in) { out = _mm_maskz_loadu_ps(mask, in); }
+inline void load(__m256 &out, __mmask8 mask, const float * in) { out = _mm256_maskz_loadu_ps(mask, in); }
+inline void load(__m512 &out, __mmask16 mask, const float * in) { out = _mm512_maskz_loadu_ps(mask, in); }
+
+inline void set1(__m128 &out, float value) { out = _mm_set1_ps(value); }
+inline void set1(__m256 &out, float value) { out = _mm256_set1_ps(value); }
+inline void set1(__m512 &out, float value) { out = _mm512_set1_ps(value); }
+
+inline void store(int32_t * out, __mmask8 mask, __m128i value) { _mm_mask_storeu_epi32(out, mask, value); }
+inline void store(int32_t * out, __mmask8 mask, __m256i value) { _mm256_mask_storeu_epi32(out, mask, value); }
+inline void store(int32_t * out, __mmask16 mask, __m512i value) { _mm512_mask_storeu_epi32(out, mask, value); }
+inline void store(float * out, __mmask8 mask, __m128 value) { _mm_mask_storeu_ps(out, mask, value); }
+inline void store(float * out, __mmask8 mask, __m256 value) { _mm256_mask_storeu_ps(out, mask, value); }
+inline void store(float * out, __mmask16 mask, __m512 value) { _mm512_mask_storeu_ps(out, mask, value); }
+// Saturates
+inline void store(int8_t * out, __mmask8 mask, __m128i value) { _mm_mask_cvtsepi32_storeu_epi8(out, mask, value); }
+inline void store(int8_t * out, __mmask8 mask, __m256i value) { _mm256_mask_cvtsepi32_storeu_epi8(out, mask, value); }
+inline void store(int8_t * out, __mmask16 mask, __m512i value) { _mm512_mask_cvtsepi32_storeu_epi8(out, mask, value); }
+
+inline __m128 toFloat(__m128i value) { return _mm_cvtepi32_ps(value); }
+inline __m256 toFloat(__m256i value) { return _mm256_cvtepi32_ps(value); }
+inline __m512 toFloat(__m512i value) { return _mm512_cvtepi32_ps(value); }
+
+// Rounds to nearest even
+inline __m128i toInt(__m128 value) { return _mm_cvtps_epi32(value); }
+inline __m256i toInt(__m256 value) { return _mm256_cvtps_epi32(value); }
+inline __m512i toInt(__m512 value) { return _mm512_cvtps_epi32(value); }
+
+inline __m128 fmadd(__m128 a, __m128 b, __m128 c) { return _mm_fmadd_ps(a, b, c); }
+inline __m256 fmadd(__m256 a, __m256 b, __m256 c) { return _mm256_fmadd_ps(a, b, c); }
+inline __m512 fmadd(__m512 a, __m512 b, __m512 c) { return _mm512_fmadd_ps(a, b, c); }
+
+inline __m128 max(__m128 a, __m128 b) { return _mm_max_ps(a, b); }
+inline __m256 max(__m256 a, __m256 b) { return _mm256_max_ps(a, b); }
+inline __m512 max(__m512 a, __m512 b) { return _mm512_max_ps(a, b); }
+
+inline __m128 min(__m128 a, __m128 b) { return _mm_min_ps(a, b); }
+inline __m256 min(__m256 a, __m256 b) { return _mm256_min_ps(a, b); }
+inline __m512 min(__m512 a, __m512 b) { return _mm512_min_ps(a, b); }
+
+// The float values of a Dequantize, stored as float or rounded and saturated to int8
+inline void storeDequantized(float * out, __mmask8 mask, __m128 value) { store(out, mask, value); }
+inline void storeDequantized(float * out, __mmask8 mask, __m256 value) { store(out, mask, value); }
+inline void storeDequantized(float * out, __mmask16 mask, __m512 value) { store(out, mask, value); }
+inline void storeDequantized(int8_t * out, __mmask8 mask, __m128 value) { store(out, mask, toInt(value)); }
+inline void storeDequantized(int8_t * out, __mmask8 mask, __m256 value) { store(out, mask, toInt(value)); }
+inline void storeDequantized(int8_t * out, __mmask16 mask, __m512 value) { store(out, mask, toInt(value)); }
+
+// What the drivers did all along: add the product to the int32 C that is already there
+struct AccumulateC {
+  static const constexpr bool shiftA = false;
+  int32_t * C;
+  size_t colsB;
+
+  AccumulateC(int32_t * C_, size_t colsB_) : C(C_), colsB(colsB_) {}
+
+  template<class Register, class Mask>
+  inline void init(Register &acc, size_t row, size_t col, Mask mask) const {
+    load(acc, mask, C + row*colsB + col);
+  }
+
+  template<class Register, class Mask>
+  inline void finish(Register acc, size_t row, size_t col, Mask mask) const {
+    store(C + row*colsB + col, mask, acc);
+  }
+};
+
+// C = min(max(scale*(A*B) + bias, lo), hi), written as float or as int8. int8 output is rounded to nearest even and saturated,
+// so scale needs to include the quantization multiplier of the output. The scale is either one for the whole tensor or one per
+// column of C, the bias is per column and optional. Leaving lo and hi at their defaults means no clamp, lo = 0 is a ReLU.
+// Unlike AccumulateC, C doesn't need to be zeroed first, it is only ever written.
+template<class Out>
+struct Dequantize {
+  static const constexpr bool shiftA = false;
+  Out * C;
+  size_t colsB;
+  const float * scale;
+  bool perColumnScale;
+  const float * bias; // colsB of them, or nullptr for none
+  float lo;
+  float hi;
+
+  Dequantize(Out * C_, size_t colsB_, const float * scale_, bool perColumnScale_ = false, const float * bias_ = nullptr,
+             float lo_ = -std::numeric_limits<float>::infinity(), float hi_ = std::numeric_limits<float>::infinity())
+    : C(C_), colsB(colsB_), scale(scale_), perColumnScale(perColumnScale_), bias(bias_), lo(lo_), hi(hi_) {}
+
+  template<class Register, class Mask>
+  inline void init(Register &acc, size_t, size_t, Mask) const {
+    setZero(acc);
+  }
+
+  template<class Register, class Mask>
+  inline void finish(Register acc, size_t row, size_t col, Mask mask) const {
+    auto result = toFloat(acc);
+    decltype(result) scales, biases, low, high;
+    if (perColumnScale) {
+      load(scales, mask, scale + col);
+    } else {
+      set1(scales, *scale);
+    }
+    if (bias) {
+      load(biases, mask, bias + col);
+    } else {
+      set1(biases, 0.0f);
+    }
+    set1(low, lo);
+    set1(high, hi);
+    result = min(max(fmadd(result, scales, biases), low), high);
+    storeDequantized(C + row*colsB + col, mask, result);
+  }
+};
+
+// Signed int8 A. dpbusds wants A unsigned, so the drivers flip the sign bit of every byte of A as they load it, which is the
+// same as adding 128 and maps [-128, 127] onto [0, 255] exactly. That adds 128*sum(B[.][j]) to every element of column j. The
+// correction from prepareShiftCorrection is -128 times the column sums of B, and init() starts the accumulator off with it,
+// so whatever the wrapped epilogue gets is the exact signed product.
+template<class Epilogue>
+struct ShiftedA {
+  static const constexpr bool shiftA = true;
+  const int32_t * correction; // colsB of them
+  Epilogue inner;
+
+  ShiftedA(const int32_t * correction_, const Epilogue &inner_) : correction(correction_), inner(inner_) {}
+
+  template<class Register, class Mask>
+  inline void init(Register &acc, size_t row, size_t col, Mask mask) const {
+    inner.init(acc, row, col, mask);
+    Register columns;
+    load(columns, mask, correction + col);
+    acc = add(acc, columns);
+  }
+
+  template<class Register, class Mask>
+  inline void finish(Register acc, size_t row, size_t col, Mask mask) const {
+    inner.finish(acc, row, col, mask);
+  }
+};
+
+template<class Epilogue>
+inline ShiftedA<Epilogue> shiftedA(const int32_t * correction, const Epilogue &inner) {
+  return ShiftedA<Epilogue>(correction, inner);
+}
+
+// The correction ShiftedA needs for the column major B (rowsB == width), colsB of them. The same for every register width.
+inline void prepareShiftCorrection(const int8_t * in, int32_t * correction, size_t rowsB, size_t colsB) {
+  for (size_t j = 0; j < colsB; j++) {
+    int32_t sum = 0;
+    for (size_t w = 0; w < rowsB; w++) {
+      sum += in[j*rowsB + w];
+    }
+    correction[j] = -128*sum;
+  }
+}
+
+} // namespace bftile
+
+BFTILE_TARGET_END
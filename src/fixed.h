@@ -0,0 +1,114 @@
+#pragma once
+#include <cstdint>
+#include <utility>
+#include "targets.h"
+
+BFTILE_TARGET_AVX512VNNI_BEGIN
+
+namespace bftile {
+/************************************************************************************ fixed shapes ************************************************************************************/
+
+// depthfirstaddrlooptileloopwritedepend with Width and ColsB known at compile time. The loops over the column blocks (j) and
+// over the width (t) are unrolled with index sequences, so every offset into A, B and C is a constant and there are no amat[]
+// and cres[] pointer arrays to fill for every tile. The numregs rows of a row block are accumulated in registers over the whole
+// width and C is written once per tile. Only the loop over the row blocks is left, since rowsA is the one dimension that
+// changes from call to call. Same contract as the wrapped gemm: rowsA a multiple of numregs, Width of regwidth, ColsB of numregs.
+// Everything is unrolled, so this is for the small shapes where the loop overhead is noticeable.
+template<size_t Width, size_t ColsB, class Runner>
+struct fixed {
+  typedef typename Runner::gemm Kernel;
+  typedef typename Kernel::Register Register;
+  static const constexpr size_t regwidth = Kernel::regwidth;
+  static const constexpr size_t numregs = Kernel::numregs;
+  static const constexpr size_t tilesK = Width/regwidth; // Tiles along the width of one column block of the reordered B
+  static const constexpr size_t colBlocks = ColsB/numregs;
+  static_assert(Width % regwidth == 0 && Width > 0, "Width has to be a multiple of the register width");
+  static_assert(ColsB % numregs == 0 && ColsB > 0, "ColsB has to be a multiple of the number of registers in a tile");
+
+  // Tile T along the width of column block J, for the numregs rows starting at A
+  template<size_t J, size_t T>
+  static inline void multiplyTile(const uint8_t * A, const Register * B, Register * res) {
+    for (size_t n = 0; n < numregs; n++) {
+      Kernel::multiplyRowSeqWrite(*reinterpret_cast<const Register *>(A + n*Width + T*regwidth), B + (J*tilesK + T)*numregs, res[n]);
+    }
+  }
+
+  template<size_t J, size_t... T>
+  static inline void multiplyColumnBlock(const uint8_t * A, const Register * B, int32_t * C, std::index_sequence<T...>) {
+    Register res[numregs];
+    for (size_t n = 0; n < numregs; n++) {
+      res[n] = *reinterpret_cast<const Register *>(C + n*ColsB + J*numregs);
+    }
+    int unroll[] = {(multiplyTile<J, T>(A, B, res), 0)...};
+    (void)unroll;
+    for (size_t n = 0; n < numregs; n++) {
+      *reinterpret_cast<Register *>(C + n*ColsB + J*numregs) = res[n];
+    }
+  }
+
+  template<size_t... J>
+  static inline void multiplyRowBlock(const uint8_t * A, const Register * B, int32_t * C, std::index_sequence<J...>) {
+    int unroll[] = {(multiplyColumnBlock<J>(A, B, C, std::make_index_sequence<tilesK>()), 0)...};
+    (void)unroll;
+  }
+
+  // width and colsB are only there for the runner interface, they have to be Width and ColsB
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t, size_t) {
+    /****** Important: C is assumed to be set to 0 ******/
+    for (size_t i = 0; i < rowsA; i += numregs) {
+      multiplyRowBlock(A + i*Width, reinterpret_cast<const Register *>(B), C + i*ColsB, std::make_index_sequence<colBlocks>());
+    }
+  }
+
+  struct runner {
+    using gemm = bftile::fixed<Width, ColsB, Runner>;
+    using prepareB = typename Runner::prepareB;
+  };
+};
+
+// One (width, colsB) for fixedShapes
+template<size_t Width, size_t ColsB>
+struct Shape {
+  static const constexpr size_t width = Width;
+  static const constexpr size_t colsB = ColsB;
+};
+
+// Dispatches to fixed<> for the shapes in Shapes, and to the generic loops of Runner for anything else. The table is searched
+// in order, so the most common shape should go first.
+template<class Runner, class... Shapes>
+struct fixedShapes {
+  typedef typename Runner::gemm Kernel;
+  typedef void (*Gemm)(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB);
+
+  struct Entry {
+    size_t width;
+    size_t colsB;
+    Gemm gemm;
+  };
+
+  static const Entry * table() {
+    static const Entry entries[] = {{Shapes::width, Shapes::colsB, &fixed<Shapes::width, Shapes::colsB, Runner>::gemm}...,
+                                    {0, 0, nullptr}}; // So that the array isn't empty when Shapes is
+    return entries;
+  }
+
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    for (const Entry * entry = table(); entry->gemm; entry++) {
+      if (entry->width == width && entry->colsB == colsB) {
+        entry->gemm(A, B, C, rowsA, width, colsB);
+        return;
+      }
+    }
+    Kernel::gemm(A, B, C, rowsA, width, colsB);
+  }
+
+  struct runner {
+    using gemm = bftile::fixedShapes<Runner, Shapes...>;
+    using prepareB = typename Runner::prepareB;
+  };
+};
+
+} // namespace bftile
+
+BFTILE_TARGET_END
@@ -0,0 +1,171 @@
+#pragma once
+#include <immintrin.h>
+#include <cstdint>
+#include "mm128.h"
+#include "mm256.h"
+#include "mm512.h"
+#include "maddubs.h"
+#include "avxvnni.h"
+#include "targets.h"
+
+/************************************************************************************ int16 ************************************************************************************/
+// int16 A times int16 B into int32 C, for layers that need more than 8 bits. Nothing about the int8 kernels is specific to
+// bytes except the dot product: prepareBtile, the shuffles of A and the drivers all move 32 bit groups around, which hold 4
+// int8 or 2 int16 just the same. A tile of B is then numregs columns by regwidth/2 int16 rows, and dpwssd multiplies and adds
+// the pairs where dpbusds did the groups of 4. So the int16 family is the int8 drivers with an int16 Accumulate policy,
+// called through widened<>, which hands them A and B as bytes and the width in bytes.
+//
+// A and B are row major and column major as for int8 and C is the same int32 row major C, so epilogues that only look at C
+// (AccumulateC, Dequantize) work as they are. A is signed already, so there is nothing for ShiftedA to do.
+//
+// Saturating clips like dpwssds and NonSaturating wraps like dpwssd. A pair of products is at most 2*32768*32768 = 2^31, one
+// past INT32_MAX, which wraps to INT32_MIN with dpwssd and madd and is clipped with dpwssds. The Madd policies, for the CPUs
+// without VNNI, wrap.
+
+BFTILE_TARGET_AVX512VNNI_BEGIN
+namespace bftile {
+namespace int16 {
+
+struct Saturating {
+  static inline __m128i dot(__m128i acc, __m128i a, __m128i b) { return _mm_dpwssds_epi32(acc, a, b); }
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpwssds_epi32(acc, a, b); }
+  static inline __m512i dot(__m512i acc, __m512i a, __m512i b) { return _mm512_dpwssds_epi32(acc, a, b); }
+};
+
+struct NonSaturating {
+  static inline __m128i dot(__m128i acc, __m128i a, __m128i b) { return _mm_dpwssd_epi32(acc, a, b); }
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpwssd_epi32(acc, a, b); }
+  static inline __m512i dot(__m512i acc, __m512i a, __m512i b) { return _mm512_dpwssd_epi32(acc, a, b); }
+};
+
+} // namespace int16
+} // namespace bftile
+BFTILE_TARGET_END
+
+BFTILE_TARGET_AVXVNNI_BEGIN
+namespace bftile {
+namespace int16 {
+namespace avxvnni {
+
+struct Saturating {
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpwssds_avx_epi32(acc, a, b); }
+};
+
+struct NonSaturating {
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_dpwssd_avx_epi32(acc, a, b); }
+};
+
+} // namespace avxvnni
+} // namespace int16
+} // namespace bftile
+BFTILE_TARGET_END
+
+BFTILE_TARGET_AVX2_BEGIN
+namespace bftile {
+namespace int16 {
+namespace avx2 {
+
+// madd is dpwssd without the accumulator, which an add makes up for
+struct Madd {
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) { return _mm256_add_epi32(acc, _mm256_madd_epi16(a, b)); }
+};
+
+} // namespace avx2
+} // namespace int16
+} // namespace bftile
+BFTILE_TARGET_END
+
+BFTILE_TARGET_AVX512BW_BEGIN
+namespace bftile {
+namespace int16 {
+namespace avx512bw {
+
+struct Madd {
+  static inline __m512i dot(__m512i acc, __m512i a, __m512i b) { return _mm512_add_epi32(acc, _mm512_madd_epi16(a, b)); }
+};
+
+} // namespace avx512bw
+} // namespace int16
+} // namespace bftile
+BFTILE_TARGET_END
+
+namespace bftile {
+namespace int16 {
+
+// An int8 runner whose gemm has an int16 Accumulate policy, taking int16 matrices. Shapes are in int16 elements and have to
+// respect the contract of the runner in bytes: a driver that needs the width to be a multiple of regwidth bytes takes widths
+// that are multiples of regwidth/2 here. Wrap parallel<> and friends inside, not outside: widened<parallel<R>::runner>.
+template<class Runner>
+struct widened {
+  typedef typename Runner::gemm Kernel;
+  typedef typename Runner::prepareB Prepare;
+
+  // In int16, not bytes
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return Prepare::preparedSize(2*rowsB, colsB)/2;
+  }
+
+  static void prepareBMatrix(const int16_t * in, int16_t * out, size_t rowsB, size_t colsB) {
+    Prepare::prepareBMatrix(reinterpret_cast<const int8_t *>(in), reinterpret_cast<int8_t *>(out), 2*rowsB, colsB);
+  }
+
+  static void gemm(const int16_t * A, const int16_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    Kernel::gemm(reinterpret_cast<const uint8_t *>(A), reinterpret_cast<const int8_t *>(B), C, rowsA, 2*width, colsB);
+  }
+
+  template<class Epilogue>
+  static void gemm(const int16_t * A, const int16_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    static_assert(!Epilogue::shiftA, "int16 A is signed already, ShiftedA would flip bytes of it");
+    Kernel::gemm(reinterpret_cast<const uint8_t *>(A), reinterpret_cast<const int8_t *>(B), rowsA, 2*width, colsB, epilogue);
+  }
+
+  struct runner {
+    using gemm = widened<Runner>;
+    using prepareB = widened<Runner>;
+  };
+};
+
+// The families of the int8 kernels, with the same names
+
+// 128 bit, like bftile::anyshape
+template<class Accumulate>
+using anyshapeWith = widened<typename bftile::anyshapeWith<Accumulate>::runner>;
+typedef anyshapeWith<Saturating> anyshape;
+
+namespace mm256 {
+template<class Accumulate>
+using depthfirstaddrlooptileloopwritedependWith = widened<typename bftile::mm256::depthfirstaddrlooptileloopwritedependWith<Accumulate>::runner>;
+typedef depthfirstaddrlooptileloopwritedependWith<Saturating> depthfirstaddrlooptileloopwritedepend;
+template<class Accumulate>
+using anyshapeWith = widened<typename bftile::mm256::anyshapeWith<Accumulate>::runner>;
+typedef anyshapeWith<Saturating> anyshape;
+} // namespace mm256
+
+namespace mm512 {
+template<class Accumulate>
+using depthfirstaddrlooptileloopwritedependWith = widened<typename bftile::mm512::depthfirstaddrlooptileloopwritedependWith<Accumulate>::runner>;
+typedef depthfirstaddrlooptileloopwritedependWith<Saturating> depthfirstaddrlooptileloopwritedepend;
+typedef widened<bftile::mm512::registeraccumulated<8, Saturating>::runner> registeraccumulated;
+template<class Accumulate>
+using anyshapeWith = widened<typename bftile::mm512::anyshapeWith<Accumulate>::runner>;
+typedef anyshapeWith<Saturating> anyshape;
+typedef widened<bftile::mm512::gemvWith<Saturating>::runner> gemv;
+} // namespace mm512
+
+namespace avxvnni {
+template<class Accumulate>
+using anyshapeWith = widened<typename bftile::avxvnni::anyshapeWith<Accumulate>::runner>;
+typedef anyshapeWith<Saturating> anyshape;
+} // namespace avxvnni
+
+namespace avx2 {
+typedef widened<bftile::avx2::anyshapeWith<Madd>::runner> anyshape;
+} // namespace avx2
+
+namespace avx512bw {
+typedef widened<bftile::avx512bw::anyshapeWith<Madd>::runner> anyshape;
+} // namespace avx512bw
+
+} // namespace int16
+} // namespace bftile
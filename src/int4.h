@@ -0,0 +1,283 @@
+#pragma once
+#include <immintrin.h>
+#include <cstdint>
+#include "utils.h"
+#include "accumulate.h"
+#include "epilogue.h"
+#include "mm512.h"
+#include "targets.h"
+
+/************************************************************************************ int4 B ************************************************************************************/
+// B with two 4 bit weights per byte. Skinny shapes like 16x2048x256 and gemv are bound by streaming the reordered B in, so
+// half the bytes of B is close to half the time, and half the memory a model's weights take.
+//
+// B comes in as int8 like everywhere else, with every value in [-8, 7]; anything outside that range loses its upper bits. It is
+// reordered into mm512::anyshape tiles first and then every two registers of a tile, 2k and 2k+1, are packed into one: the
+// weights of 2k go into the low nibbles, those of 2k+1 into the high ones. The nibbles hold weight + 8, so that unpacking to
+// int8 is a mask (and a shift for the high nibbles) and one subtract, right before the dpbusds. A tile is numregs/2 registers
+// instead of numregs and the tiles are in the same depth first order as anyshape's, zero padded the same way.
+//
+// Only the 512 bit family: it is the one with the masks and the register count to spare for the unpacking.
+
+BFTILE_TARGET_AVX512VNNI_BEGIN
+namespace bftile {
+namespace int4 {
+namespace mm512 {
+
+typedef __m512i Register;
+static const constexpr size_t regwidth = sizeof(Register);
+static const constexpr size_t numregs = sizeof(Register)/4; // Registers of an unpacked tile
+static const constexpr size_t packedregs = numregs/2; // Registers of a packed tile
+
+// Two registers of int8 in [-8, 7] into one of nibbles
+inline Register pack(Register low, Register high) {
+  const Register nibble = _mm512_set1_epi8(0x0f);
+  const Register offset = _mm512_set1_epi8(8);
+  low = _mm512_and_si512(_mm512_xor_si512(low, offset), nibble); // xor with 8 is adding 8, modulo 16
+  high = _mm512_and_si512(_mm512_xor_si512(high, offset), nibble);
+  return _mm512_or_si512(low, _mm512_slli_epi16(high, 4)); // high has nothing in its upper nibbles to shift into the next byte
+}
+
+inline void unpack(const Register packed, Register &low, Register &high) {
+  const Register nibble = _mm512_set1_epi8(0x0f);
+  const Register offset = _mm512_set1_epi8(8);
+  low = _mm512_sub_epi8(_mm512_and_si512(packed, nibble), offset);
+  high = _mm512_sub_epi8(_mm512_and_si512(_mm512_srli_epi16(packed, 4), nibble), offset);
+}
+
+// A whole tile, as prepareBtile left it
+inline void unpackTile(const Register * packed, Register * tile) {
+  for (size_t k = 0; k < packedregs; k++) {
+    unpack(packed[k], tile[2*k], tile[2*k + 1]);
+  }
+}
+
+// Any shape, mm512::anyshape on a packed B. Each tile is unpacked once per numregs rows of A, into memory that stays in L1,
+// and then goes through multiplyRowSeqWrite as usual.
+template<class Accumulate>
+struct anyshapeWith {
+  typedef bftile::mm512::anyshapeWith<Accumulate> Unpacked;
+  static const constexpr size_t regwidth = mm512::regwidth;
+  static const constexpr size_t numregs = mm512::numregs;
+  static const constexpr uint32_t registerBits = 8*sizeof(Register); // What the prepared B looks like, for serialize.h
+  static const constexpr PreparedLayout layout = PreparedLayout::packedInt4;
+
+  static inline size_t tilesPerColumn(size_t rowsB) {
+    return Unpacked::tilesPerColumn(rowsB);
+  }
+
+  // Size in bytes of the packed B, including the padding. Half of anyshape's.
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return tilesPerColumn(rowsB)*((colsB + numregs - 1)/numregs)*packedregs*regwidth;
+  }
+
+  static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    prepareBMatrixBlock(in, out, rowsB, colsB, 0, colsB);
+  }
+
+  // Only the column blocks in [colBegin, colEnd), like anyshape::prepareBMatrixBlock
+  static void prepareBMatrixBlock(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB, size_t colBegin, size_t colEnd) {
+    Register* outmat = reinterpret_cast<Register*>(out) + (colBegin/numregs)*tilesPerColumn(rowsB)*packedregs;
+    const bool stream = streamPrepared(out, preparedSize(rowsB, colsB), regwidth);
+    Register intile[numregs];
+    Register outtile[numregs];
+    for (size_t i = colBegin; i < colEnd; i += numregs) {
+      for (size_t j = 0; j < rowsB; j += regwidth) {
+        __mmask64 rowmask = Unpacked::byteMask(rowsB - j);
+        for (size_t t = 0; t < numregs; t++) {
+          intile[t] = i + t < colsB ? _mm512_maskz_loadu_epi8(rowmask, &in[(i + t)*rowsB + j]) : _mm512_setzero_si512();
+        }
+        bftile::mm512::prepareBtile(intile, outtile);
+        for (size_t k = 0; k < packedregs; k++) {
+          const Register packed = pack(outtile[2*k], outtile[2*k + 1]);
+          if (stream) {
+            _mm512_stream_si512(outmat + k, packed);
+          } else {
+            _mm512_storeu_si512(outmat + k, packed);
+          }
+        }
+        outmat = outmat + packedregs;
+      }
+    }
+    if (stream) {
+      _mm_sfence(); // Streaming stores are weakly ordered, make sure they are all visible before anyone reads the matrix
+    }
+  }
+
+  // Also writes the colsB column sum corrections that gemmShifted needs for a signed A
+  static void prepareBMatrix(const int8_t * in, int8_t * out, int32_t * correction, size_t rowsB, size_t colsB) {
+    prepareBMatrix(in, out, rowsB, colsB);
+    prepareShiftCorrection(in, correction, rowsB, colsB);
+  }
+
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // C is whatever the epilogue (see epilogue.h) makes of the product, for example dequantized floats
+  template<class Epilogue>
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    gemmBlock(A, B, width, colsB, 0, rowsA, 0, colsB, 0, width, epilogue);
+  }
+
+  // Signed int8 A, with the correction from prepareBMatrix above. The result is exact, see ShiftedA.
+  static void gemmShifted(const int8_t * A, const int8_t * B, const int32_t * correction, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemm(reinterpret_cast<const uint8_t *>(A), B, rowsA, width, colsB, shiftedA(correction, AccumulateC(C, colsB)));
+  }
+
+  // Same contract as anyshape::gemmBlock
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    gemmBlock(A, B, width, colsB, rowBegin, rowEnd, colBegin, colEnd, kBegin, kEnd, AccumulateC(C, colsB));
+  }
+
+  template<class Epilogue>
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, size_t width, size_t, size_t rowBegin,
+                                                 size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    const size_t tiles = tilesPerColumn(width);
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*packedregs;
+    Register cres[numregs];
+    Register tile[numregs];
+    for (size_t j = colBegin; j < colEnd; j += numregs) { // 64/4=16
+      const __mmask16 colmask = Unpacked::columnMask(colEnd - j);
+      for (size_t i = rowBegin; i < rowEnd; i += numregs) { // 64/4=16
+        const size_t rows = rowEnd - i < numregs ? rowEnd - i : numregs;
+        for (size_t n = 0; n < rows; n++) {
+          epilogue.init(cres[n], i+n, j, colmask);
+        }
+        const Register * breord_cur = breord + (kBegin/regwidth)*packedregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) {
+          const __mmask64 amask = Unpacked::byteMask(width - t);
+          unpackTile(breord_cur, tile);
+          for (size_t n = 0; n < rows; n++) {
+            bftile::mm512::depthfirstaddrlooptileloopwritedependWith<Accumulate>::multiplyRowSeqWrite(
+                Unpacked::template loadA<Epilogue>(amask, A + (i+n)*width + t), tile, cres[n]);
+          }
+          breord_cur = breord_cur + packedregs;
+        }
+        for (size_t n = 0; n < rows; n++) {
+          epilogue.finish(cres[n], i+n, j, colmask);
+        }
+      }
+      breord = breord + tiles*packedregs;
+    }
+  }
+
+  struct runner {
+    using gemm = anyshapeWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct anyshape
+typedef anyshapeWith<Saturating> anyshape;
+
+// mm512::gemv on a packed B. The rows of A are permuted first, and every register of B is then unpacked once and multiplied
+// with all of the rows, instead of once per row. The permuted rows take more registers than there are and live in L1.
+template<class Accumulate>
+struct gemvWith {
+  typedef bftile::mm512::anyshapeWith<Accumulate> Unpacked;
+  static const constexpr size_t regwidth = mm512::regwidth;
+  static const constexpr size_t numregs = mm512::numregs;
+  static const constexpr size_t maxRows = bftile::mm512::gemvWith<Accumulate>::maxRows;
+  static const constexpr size_t colBlocksPerStep = bftile::mm512::gemvWith<Accumulate>::colBlocksPerStep;
+
+  // Rows x ColBlocks tiles of C over [kBegin, kEnd) of the width. breord points at the first column block, at the tile where
+  // kBegin is, and column blocks are tileStride registers apart.
+  template<size_t Rows, size_t ColBlocks, class Epilogue>
+  static inline void multiplyStrip(const uint8_t * A, const Register * breord, size_t tileStride, size_t width, size_t row, size_t col,
+                                   const __mmask16 * colmasks, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    Register cres[Rows][ColBlocks];
+    for (size_t n = 0; n < Rows; n++) {
+      for (size_t b = 0; b < ColBlocks; b++) {
+        epilogue.init(cres[n][b], row + n, col + b*numregs, colmasks[b]);
+      }
+    }
+    Register permuted[Rows][numregs];
+    for (size_t t = kBegin; t < kEnd; t += regwidth) {
+      const __mmask64 amask = Unpacked::byteMask(width - t);
+      for (size_t n = 0; n < Rows; n++) {
+        bftile::mm512::packedAWith<Accumulate>::permuteRow(Unpacked::template loadA<Epilogue>(amask, A + (row + n)*width + t), permuted[n]);
+      }
+      for (size_t k = 0; k < packedregs; k++) {
+        for (size_t b = 0; b < ColBlocks; b++) {
+          Register low, high;
+          unpack(breord[b*tileStride + k], low, high);
+          for (size_t n = 0; n < Rows; n++) {
+            cres[n][b] = Accumulate::dot(cres[n][b], permuted[n][2*k], low);
+            cres[n][b] = Accumulate::dot(cres[n][b], permuted[n][2*k + 1], high);
+          }
+        }
+      }
+      breord = breord + packedregs;
+    }
+    for (size_t n = 0; n < Rows; n++) {
+      for (size_t b = 0; b < ColBlocks; b++) {
+        epilogue.finish(cres[n][b], row + n, col + b*numregs, colmasks[b]);
+      }
+    }
+  }
+
+  // The rows [row, row + Rows) of C against the columns [colBegin, colEnd)
+  template<size_t Rows, class Epilogue>
+  static void multiplyRows(const uint8_t * A, const int8_t * B, size_t width, size_t row, size_t colBegin, size_t colEnd,
+                           size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    const size_t tiles = Unpacked::tilesPerColumn(width);
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*packedregs + (kBegin/regwidth)*packedregs;
+    __mmask16 colmasks[colBlocksPerStep];
+    size_t j = colBegin;
+    for (; j + colBlocksPerStep*numregs <= colEnd; j += colBlocksPerStep*numregs) {
+      for (size_t b = 0; b < colBlocksPerStep; b++) {
+        colmasks[b] = Unpacked::columnMask(colEnd - j - b*numregs);
+      }
+      multiplyStrip<Rows, colBlocksPerStep>(A, breord, tiles*packedregs, width, row, j, colmasks, kBegin, kEnd, epilogue);
+      breord = breord + colBlocksPerStep*tiles*packedregs;
+    }
+    for (; j < colEnd; j += numregs) {
+      colmasks[0] = Unpacked::columnMask(colEnd - j);
+      multiplyStrip<Rows, 1>(A, breord, tiles*packedregs, width, row, j, colmasks, kBegin, kEnd, epilogue);
+      breord = breord + tiles*packedregs;
+    }
+  }
+
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // C is whatever the epilogue (see epilogue.h) makes of the product
+  template<class Epilogue>
+  static void gemm(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    gemmBlock(A, B, width, colsB, 0, rowsA, 0, colsB, 0, width, epilogue);
+  }
+
+  // Same contract as anyshape::gemmBlock
+  static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                        size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    gemmBlock(A, B, width, colsB, rowBegin, rowEnd, colBegin, colEnd, kBegin, kEnd, AccumulateC(C, colsB));
+  }
+
+  template<class Epilogue>
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, size_t width, size_t, size_t rowBegin, size_t rowEnd,
+                                                 size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    for (size_t i = rowBegin; i < rowEnd; i += maxRows) {
+      switch (rowEnd - i < maxRows ? rowEnd - i : maxRows) {
+        case 1: multiplyRows<1>(A, B, width, i, colBegin, colEnd, kBegin, kEnd, epilogue); break;
+        case 2: multiplyRows<2>(A, B, width, i, colBegin, colEnd, kBegin, kEnd, epilogue); break;
+        case 3: multiplyRows<3>(A, B, width, i, colBegin, colEnd, kBegin, kEnd, epilogue); break;
+        default: multiplyRows<maxRows>(A, B, width, i, colBegin, colEnd, kBegin, kEnd, epilogue); break;
+      }
+    }
+  }
+
+  struct runner {
+    using gemm = gemvWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct gemv
+typedef gemvWith<Saturating> gemv;
+
+} // namespace mm512
+} // namespace int4
+} // namespace bftile
+BFTILE_TARGET_END
@@ -0,0 +1,304 @@
+#pragma once
+#include <immintrin.h>
+#include <cstring>
+#include "aligned.h"
+#include "utils.h"
+#include "mm256.h"
+#include "mm512.h"
+#include "targets.h"
+
+/************************************************************************************ fallbacks without VNNI ************************************************************************************/
+// Every kernel of mm128.h, mm256.h and mm512.h multiplies with dpbusds, which only the CPUs with AVX512VNNI have. The kernels
+// here do the same uint8 x int8 dot products with maddubs and madd instead, on AVX2 (avx2::) and on AVX512 without VNNI
+// (avx512bw::). B is reordered exactly like the anyshape kernel of the same register width does it, with the same prepareBtile,
+// so a prepared B is byte for byte the same as mm256::anyshape's or mm512::anyshape's. A is permuted with the same shuffles.
+//
+// maddubs adds pairs of uint8 x int8 products into int16 and saturates: 255*127 + 255*127 doesn't fit. To stay exact over the
+// whole uint8 range, A is split into its low 7 bits and its top bit. Pairs of the low parts are at most 127*128*2 = 32512, pairs
+// of the top bits are multiples of 128 in [-32768, 32512], so both fit int16 exactly. madd with ones then widens them to int32
+// sums of 4 products, which is what dpbusd computes. That's two maddubs, two madd and two adds where VNNI has one instruction,
+// and there is no saturating int32 add, so the results wrap like NonSaturating (see accumulate.h) and not clip like Saturating.
+// Only int32 C, the epilogues of epilogue.h need VNNI.
+
+BFTILE_TARGET_AVX2_BEGIN
+namespace bftile {
+namespace avx2 {
+
+// Accumulate policy computing dpbusd with maddubs, as described above
+struct Maddubs {
+  static inline __m256i dot(__m256i acc, __m256i a, __m256i b) {
+    const __m256i low7 = _mm256_set1_epi8(0x7f);
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i alow = _mm256_and_si256(a, low7);
+    const __m256i ahigh = _mm256_xor_si256(a, alow);
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(alow, b), ones));
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(ahigh, b), ones));
+  }
+};
+
+// mm256::anyshape on AVX2. Without masks the edges are copied into zero padded registers instead: B when it is prepared and A
+// as it is read. The edges of C are read and written with maskload and maskstore.
+template<class Accumulate>
+struct anyshapeWith {
+  typedef __m256i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+  static const constexpr uint32_t registerBits = 8*sizeof(Register); // What the prepared B looks like, for serialize.h
+  static const constexpr PreparedLayout layout = PreparedLayout::anyshape;
+
+  // The first n bytes at in, zero padded to a register. n may be larger than the register.
+  static inline Register loadPadded(const void * in, size_t n) {
+    if (n >= regwidth) {
+      return _mm256_loadu_si256(reinterpret_cast<const Register *>(in));
+    }
+    alignas(Register) uint8_t padded[regwidth] = {0};
+    std::memcpy(padded, in, n);
+    return _mm256_load_si256(reinterpret_cast<const Register *>(padded));
+  }
+
+  // Selects the first n int32 of a register for maskload and maskstore
+  static inline Register columnMask(size_t n) {
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(n < numregs ? n : numregs)), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  }
+
+  // Number of tiles of B in one column block, the last one is zero padded
+  static inline size_t tilesPerColumn(size_t rowsB) {
+    return (rowsB + regwidth - 1)/regwidth;
+  }
+
+  // Size in bytes of the reordered B, including the padding
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return tilesPerColumn(rowsB)*((colsB + numregs - 1)/numregs)*numregs*regwidth;
+  }
+
+  static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    prepareBMatrixBlock(in, out, rowsB, colsB, 0, colsB);
+  }
+
+  // Only the column blocks in [colBegin, colEnd), like mm256::anyshape::prepareBMatrixBlock
+  static void prepareBMatrixBlock(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB, size_t colBegin, size_t colEnd) {
+    Register* outmat = reinterpret_cast<Register*>(out) + (colBegin/numregs)*tilesPerColumn(rowsB)*numregs;
+    const bool stream = streamPrepared(out, preparedSize(rowsB, colsB), regwidth);
+    Register intile[numregs];
+    Register outtile[numregs];
+    for (size_t i = colBegin; i < colEnd; i += numregs) {
+      for (size_t j = 0; j < rowsB; j += regwidth) {
+        for (size_t t = 0; t < numregs; t++) {
+          intile[t] = i + t < colsB ? loadPadded(&in[(i + t)*rowsB + j], rowsB - j) : _mm256_setzero_si256();
+        }
+        mm256::prepareBtile(intile, outtile);
+        mm256::storeTile(outtile, outmat, stream);
+        outmat = outmat + numregs;
+      }
+    }
+    if (stream) {
+      _mm_sfence(); // Streaming stores are weakly ordered, make sure they are all visible before anyone reads the matrix
+    }
+  }
+
+  // One row of A against one tile of B, mm256::depthfirstaddrlooptileloopwritedepend::multiplyRowSeqWrite with another dot
+  static inline void multiplyRow(const Register a, const Register * breord, Register &res) {
+    auto static const constexpr mask1 = _MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
+    auto static const constexpr mask2 = _MM_SHUFFLE(1,0,2,3);
+    auto static const constexpr mask3 = _MM_SHUFFLE(0,1,3,2);
+
+    res = Accumulate::dot(res, a, breord[0]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(a, mask1), breord[1]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(a, mask2), breord[2]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(a, mask3), breord[3]);
+
+    const Register laneSwappedA = _mm256_permute2x128_si256(a, a, 0b0101);
+    res = Accumulate::dot(res, laneSwappedA, breord[4]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(laneSwappedA, mask1), breord[5]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(laneSwappedA, mask2), breord[6]);
+    res = Accumulate::dot(res, _mm256_shuffle_epi32(laneSwappedA, mask3), breord[7]);
+  }
+
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // Same contract as mm256::anyshape::gemmBlock
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    const size_t tiles = tilesPerColumn(width);
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*numregs;
+    Register cres[numregs];
+    for (size_t j = colBegin; j < colEnd; j += numregs) { // 32/4=8
+      const Register colmask = columnMask(colEnd - j);
+      for (size_t i = rowBegin; i < rowEnd; i += numregs) { // 32/4=8
+        const size_t rows = rowEnd - i < numregs ? rowEnd - i : numregs;
+        for (size_t n = 0; n < rows; n++) {
+          cres[n] = _mm256_maskload_epi32(reinterpret_cast<const int *>(C + (i+n)*colsB + j), colmask);
+        }
+        const Register * breord_cur = breord + (kBegin/regwidth)*numregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) {
+          for (size_t n = 0; n < rows; n++) {
+            multiplyRow(loadPadded(A + (i+n)*width + t, width - t), breord_cur, cres[n]);
+          }
+          breord_cur = breord_cur + numregs; // 32/4=8
+        }
+        for (size_t n = 0; n < rows; n++) {
+          _mm256_maskstore_epi32(reinterpret_cast<int *>(C + (i+n)*colsB + j), colmask, cres[n]);
+        }
+      }
+      breord = breord + tiles*numregs;
+    }
+  }
+
+  struct runner {
+    using gemm = anyshapeWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct anyshape
+typedef anyshapeWith<Maddubs> anyshape;
+
+} // namespace avx2
+} // namespace bftile
+BFTILE_TARGET_END
+
+BFTILE_TARGET_AVX512BW_BEGIN
+namespace bftile {
+namespace avx512bw {
+
+// Accumulate policy computing dpbusd with maddubs, as described above
+struct Maddubs {
+  static inline __m512i dot(__m512i acc, __m512i a, __m512i b) {
+    const __m512i low7 = _mm512_set1_epi8(0x7f);
+    const __m512i ones = _mm512_set1_epi16(1);
+    const __m512i alow = _mm512_and_si512(a, low7);
+    const __m512i ahigh = _mm512_xor_si512(a, alow);
+    acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_maddubs_epi16(alow, b), ones));
+    return _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_maddubs_epi16(ahigh, b), ones));
+  }
+};
+
+// mm512::anyshape on AVX512 without VNNI. The masked loads and stores are all AVX512BW, so the edges work the same way.
+template<class Accumulate>
+struct anyshapeWith {
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+  static const constexpr uint32_t registerBits = 8*sizeof(Register); // What the prepared B looks like, for serialize.h
+  static const constexpr PreparedLayout layout = PreparedLayout::anyshape;
+
+  // Masks selecting the first n elements, n may be larger than the register
+  static inline __mmask64 byteMask(size_t n) {
+    return n >= regwidth ? (__mmask64)-1 : (__mmask64)(((__mmask64)1 << n) - 1);
+  }
+
+  static inline __mmask16 columnMask(size_t n) {
+    return n >= numregs ? (__mmask16)((1u << numregs) - 1) : (__mmask16)((1u << n) - 1);
+  }
+
+  // Number of tiles of B in one column block, the last one is zero padded
+  static inline size_t tilesPerColumn(size_t rowsB) {
+    return (rowsB + regwidth - 1)/regwidth;
+  }
+
+  // Size in bytes of the reordered B, including the padding
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return tilesPerColumn(rowsB)*((colsB + numregs - 1)/numregs)*numregs*regwidth;
+  }
+
+  static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    prepareBMatrixBlock(in, out, rowsB, colsB, 0, colsB);
+  }
+
+  // Only the column blocks in [colBegin, colEnd), like mm512::anyshape::prepareBMatrixBlock
+  static void prepareBMatrixBlock(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB, size_t colBegin, size_t colEnd) {
+    Register* outmat = reinterpret_cast<Register*>(out) + (colBegin/numregs)*tilesPerColumn(rowsB)*numregs;
+    const bool stream = streamPrepared(out, preparedSize(rowsB, colsB), regwidth);
+    Register intile[numregs];
+    Register outtile[numregs];
+    for (size_t i = colBegin; i < colEnd; i += numregs) {
+      for (size_t j = 0; j < rowsB; j += regwidth) {
+        __mmask64 rowmask = byteMask(rowsB - j);
+        for (size_t t = 0; t < numregs; t++) {
+          intile[t] = i + t < colsB ? _mm512_maskz_loadu_epi8(rowmask, &in[(i + t)*rowsB + j]) : _mm512_setzero_si512();
+        }
+        mm512::prepareBtile(intile, outtile);
+        mm512::storeTile(outtile, outmat, stream);
+        outmat = outmat + numregs;
+      }
+    }
+    if (stream) {
+      _mm_sfence(); // Streaming stores are weakly ordered, make sure they are all visible before anyone reads the matrix
+    }
+  }
+
+  // One row of A against one tile of B, mm512::depthfirstaddrlooptileloopwritedepend::multiplyRowSeqWrite with another dot
+  static inline void multiplyRow(const Register a, const Register * breord, Register &res) {
+    auto static const constexpr mask1 = (_MM_PERM_ENUM)_MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
+    auto static const constexpr mask2 = (_MM_PERM_ENUM)_MM_SHUFFLE(1,0,2,3);
+    auto static const constexpr mask3 = (_MM_PERM_ENUM)_MM_SHUFFLE(0,1,3,2);
+
+    res = Accumulate::dot(res, a, breord[0]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(a, mask1), breord[1]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(a, mask2), breord[2]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(a, mask3), breord[3]);
+
+    Register laneSwappedA = _mm512_shuffle_i32x4(a, a, 0b0100'1110);
+    res = Accumulate::dot(res, laneSwappedA, breord[4]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask1), breord[5]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask2), breord[6]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask3), breord[7]);
+
+    laneSwappedA = _mm512_shuffle_i32x4(a, a, 0b0001'1011);
+    res = Accumulate::dot(res, laneSwappedA, breord[8]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask1), breord[9]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask2), breord[10]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask3), breord[11]);
+
+    laneSwappedA = _mm512_shuffle_i32x4(a, a, 0b1011'0001);
+    res = Accumulate::dot(res, laneSwappedA, breord[12]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask1), breord[13]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask2), breord[14]);
+    res = Accumulate::dot(res, _mm512_shuffle_epi32(laneSwappedA, mask3), breord[15]);
+  }
+
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // Same contract as mm512::anyshape::gemmBlock
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    const size_t tiles = tilesPerColumn(width);
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*numregs;
+    Register cres[numregs];
+    for (size_t j = colBegin; j < colEnd; j += numregs) { // 64/4=16
+      const __mmask16 colmask = columnMask(colEnd - j);
+      for (size_t i = rowBegin; i < rowEnd; i += numregs) { // 64/4=16
+        const size_t rows = rowEnd - i < numregs ? rowEnd - i : numregs;
+        for (size_t n = 0; n < rows; n++) {
+          cres[n] = _mm512_maskz_loadu_epi32(colmask, C + (i+n)*colsB + j);
+        }
+        const Register * breord_cur = breord + (kBegin/regwidth)*numregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) {
+          const __mmask64 amask = byteMask(width - t);
+          for (size_t n = 0; n < rows; n++) {
+            multiplyRow(_mm512_maskz_loadu_epi8(amask, A + (i+n)*width + t), breord_cur, cres[n]);
+          }
+          breord_cur = breord_cur + numregs; // 64/4=16
+        }
+        for (size_t n = 0; n < rows; n++) {
+          _mm512_mask_storeu_epi32(C + (i+n)*colsB + j, colmask, cres[n]);
+        }
+      }
+      breord = breord + tiles*numregs;
+    }
+  }
+
+  struct runner {
+    using gemm = anyshapeWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct anyshape
+typedef anyshapeWith<Maddubs> anyshape;
+
+} // namespace avx512bw
+} // namespace bftile
+BFTILE_TARGET_END
@@ -1,6 +1,17 @@
+#pragma once
 #include <immintrin.h>
 #include <cstring>
 #include <iostream>
+#include <stdexcept>
+#include "aligned.h"
+#include "utils.h"
+#include "accumulate.h"
+#include "epilogue.h"
+#include "targets.h"
+
+// The B tile shuffles and stores need nothing beyond AVX512BW, so they are shared with the fallbacks of maddubs.h, which prepare
+// the exact same layout
+BFTILE_TARGET_AVX512BW_BEGIN
 
 namespace bftile {
   namespace mm512 {
@@ -93,14 +104,12 @@ inline void swapLanes(__m512i *input, __m512i *output) {
   }
 }
 
-void prepareBtile(__m512i *bmat, __m512i *breord) {
+inline void prepareBtile(__m512i *bmat, __m512i *breord) {
   // Split into two parts that do identical things, except with lane swapped bmat
   prepareBtileSubRoutine(bmat, breord);
 
-  //Second part of shuffling requires us to lane swap all of bmat
-  __m512i * bmatlaneswap = reinterpret_cast<__m512i*>(aligned_alloc(32*8*sizeof(int8_t), 1024));
-  std::memcpy(bmatlaneswap, bmat, 32*8*sizeof(int8_t));
-
+  //Second part of shuffling requires us to lane swap all of bmat. swapLanes overwrites every register, so this needs no initialising
+  __m512i bmatlaneswap[16];
 
   swapLanes<0b0100'1110>(bmat, bmatlaneswap);
   prepareBtileSubRoutine(bmatlaneswap, &breord[4]);
@@ -112,12 +121,30 @@ void prepareBtile(__m512i *bmat, __m512i *breord) {
   //Forth shuffling
   swapLanes<0b1011'0001>(bmat, bmatlaneswap);
   prepareBtileSubRoutine(bmatlaneswap, &breord[12]);
+}
 
-  delete bmatlaneswap;
+// Writes one prepared tile. Streaming stores go around the caches, which is what we want for big matrices that are prepared once
+// when a model is loaded and not read again until much later (see streamPrepared). They need out aligned to a register.
+inline void storeTile(const __m512i * tile, __m512i * out, bool stream) {
+  for (int k = 0; k < 16; k++) {
+    if (stream) {
+      _mm512_stream_si512(out + k, tile[k]);
+    } else {
+      _mm512_storeu_si512(out + k, tile[k]);
+    }
+  }
 }
 
+  } // namespace mm512
+} // namespace bftile
+BFTILE_TARGET_END
+
+BFTILE_TARGET_AVX512VNNI_BEGIN
+namespace bftile {
+  namespace mm512 {
 
-void multiplyTile(__m512i * amat, __m512i * breord, __m512i * res) {
+
+inline void multiplyTile(__m512i * amat, __m512i * breord, __m512i * res) {
   __m512i atmp; // Temporary register for reodering A
   __m512i laneSwappedA;
 
@@ -215,31 +242,60 @@ void multiplyTile(__m512i * amat, __m512i * breord, __m512i * res) {
 }
 
 struct depthfirst {
+  // What the prepared B looks like, for serialize.h
+  static const constexpr uint32_t registerBits = 8*sizeof(__m512i);
+  static const constexpr PreparedLayout layout = PreparedLayout::depthfirst;
+
+  // Size in bytes of the reordered B
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return rowsB*colsB;
+  }
+
   static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    prepareBMatrixBlock(in, out, rowsB, colsB, 0, colsB);
+  }
+
+  // Only the column blocks in [colBegin, colEnd), colBegin a multiple of numregs. Different blocks write to different parts of out,
+  // so they can be prepared on different threads (see parallel<>::prepareB).
+  static void prepareBMatrixBlock(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB, size_t colBegin, size_t colEnd) {
     // We traverse the matrix depth first, 4 columns at a time
     typedef __m512i Register;
     static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
     static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
-    Register* outmat = reinterpret_cast<Register*>(out);
+    Register* outmat = reinterpret_cast<Register*>(out) + (colBegin/numregs)*(rowsB/regwidth)*numregs; // Skip the column blocks to the left of ours
+    const bool stream = streamPrepared(out, preparedSize(rowsB, colsB), regwidth);
     Register intile[numregs];
-    for (size_t i = 0; i < colsB; i += numregs ) {  // Our tile size is 64, 4*16. We read it 4 columns at a time (sizeof(__m128i)/4 = 4)
+    Register outtile[numregs];
+    for (size_t i = colBegin; i < colEnd; i += numregs ) {  // Our tile size is 64, 4*16. We read it 4 columns at a time (sizeof(__m128i)/4 = 4)
       size_t column_start = i*rowsB; // We go 4 further 4 columns to the right
       for (size_t j = 0; j < rowsB; j += regwidth) { // We go 16 rows down at a time. 16 is what fits in one register
         size_t offset = column_start + j;
-        for (size_t t = 0; t < numregs; t++) { // Copy a subpart of the matrix onto a tile. @TODO optimise, do away with the copy
-          std::memcpy(&intile[t], &in[offset], regwidth);
+        for (size_t t = 0; t < numregs; t++) { // Load straight from B into the tile
+          intile[t] = _mm512_loadu_si512(reinterpret_cast<const Register *>(&in[offset]));
           offset += rowsB; // B comes in as a column major already so to go to the next column we need to += one column
         }
-        prepareBtile(intile, outmat);
+        prepareBtile(intile, outtile);
+        storeTile(outtile, outmat, stream);
         outmat = outmat + numregs; // Advance the pointer of the output reorder matrix by 4x__m128i
       }
     }
+    if (stream) {
+      _mm_sfence(); // Streaming stores are weakly ordered, make sure they are all visible before anyone reads the matrix
+    }
   }
+
 };
 
-struct depthfirstaddrlooptileloopwritedepend {
+// The drivers from here on take an Accumulate policy (see accumulate.h), their plain names are the Saturating versions
+template<class Accumulate>
+struct depthfirstaddrlooptileloopwritedependWith {
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
 
-  static inline void multiplyTileSeqWrite(const __m512i ** amat, const __m512i * breord, __m512i ** res) {
+
+  // One row of A against one tile of B. Split out of multiplyTileSeqWrite so that drivers which load A themselves can use it
+  static inline void multiplyRowSeqWrite(const __m512i a, const __m512i * breord, __m512i &res) {
     __m512i atmp; // Temporary register for reodering A
     __m512i laneSwappedA;
 
@@ -248,125 +304,731 @@ struct depthfirstaddrlooptileloopwritedepend {
     // on the fly, it is kept in registers which should make the operation crazy fast.
     // B is accessed consecutively and the whole tile could be kept into registers if we unroll the loop
     // C is accessed one register at a time and consecutively. No expensive scatter instructions
+
+    // We load A once, perform four multiply-adds and write into C. The four dpbusds operations will produce for consecutive for-major *results
+    // Additional work is 3 permute operations and additional space required is one temporary register
+
+    // Multiply 0
+    res = Accumulate::dot(res, a, breord[0]);
+
+    // Multiply 1: //Shuffle A in the same way as B was permuted and the multiply
+    auto static const constexpr mask1 = (_MM_PERM_ENUM)_MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
+    atmp = _mm512_shuffle_epi32(a, mask1);
+    res = Accumulate::dot(res, atmp, breord[1]);
+
+    // Multiply 2: //Shuffle A in the same way as B was permuted and the multiply
+    auto static const constexpr mask2 = (_MM_PERM_ENUM)_MM_SHUFFLE(1,0,2,3);
+    atmp = _mm512_shuffle_epi32(a, mask2);
+    res = Accumulate::dot(res, atmp, breord[2]);
+
+    // Multiply 3: //Shuffle A in the same way as B was permuted and the multiply
+    auto static const constexpr mask3 = (_MM_PERM_ENUM)_MM_SHUFFLE(0,1,3,2); // it's reversed because of being big endian
+    atmp = _mm512_shuffle_epi32(a, mask3);
+    res = Accumulate::dot(res, atmp, breord[3]);
+
+    //Lane swap a here:
+    laneSwappedA = _mm512_shuffle_i32x4(a, a, 0b0100'1110);
+
+    // Multiply 4
+    res = Accumulate::dot(res, laneSwappedA, breord[4]);
+
+    // Multiply 5: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask1 = _MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask1);
+    res = Accumulate::dot(res, atmp, breord[5]);
+
+    // Multiply 6: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask2 = _MM_SHUFFLE(1,0,2,3);
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask2);
+    res = Accumulate::dot(res, atmp, breord[6]);
+
+    // Multiply 7: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask3 = _MM_SHUFFLE(0,1,3,2); // it's reversed because of being big endian
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask3);
+    res = Accumulate::dot(res, atmp, breord[7]);
+
+    //Lane swap a here:
+    laneSwappedA = _mm512_shuffle_i32x4(a, a, 0b0001'1011);
+
+    // Multiply 8
+    res = Accumulate::dot(res, laneSwappedA, breord[8]);
+
+    // Multiply 9: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask1 = _MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask1);
+    res = Accumulate::dot(res, atmp, breord[9]);
+
+    // Multiply 10: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask2 = _MM_SHUFFLE(1,0,2,3);
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask2);
+    res = Accumulate::dot(res, atmp, breord[10]);
+
+    // Multiply 11: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask3 = _MM_SHUFFLE(0,1,3,2); // it's reversed because of being big endian
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask3);
+    res = Accumulate::dot(res, atmp, breord[11]);
+
+    //Lane swap a here:
+    laneSwappedA = _mm512_shuffle_i32x4(a, a, 0b1011'0001);
+
+    // Multiply 12
+    res = Accumulate::dot(res, laneSwappedA, breord[12]);
+
+    // Multiply 13: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask1 = _MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask1);
+    res = Accumulate::dot(res, atmp, breord[13]);
+
+    // Multiply 14: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask2 = _MM_SHUFFLE(1,0,2,3);
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask2);
+    res = Accumulate::dot(res, atmp, breord[14]);
+
+    // Multiply 15: //Shuffle A in the same way as B was permuted and the multiply
+    // auto static const constexpr mask3 = _MM_SHUFFLE(0,1,3,2); // it's reversed because of being big endian
+    atmp = _mm512_shuffle_epi32(laneSwappedA, mask3);
+    res = Accumulate::dot(res, atmp, breord[15]);
+  }
+
+  static inline void multiplyTileSeqWrite(const __m512i ** amat, const __m512i * breord, __m512i ** res) {
     for (int i = 0; i < 16; i++) {
-      // We load A once, perform four multiply-adds and write into C. The four dpbusds operations will produce for consecutive for-major *results
-      // Additional work is 3 permute operations and additional space required is one temporary register
-
-      // Multiply 0
-      *res[i] = _mm512_dpbusds_epi32 (*res[i], *amat[i], breord[0]);
-
-      // Multiply 1: //Shuffle A in the same way as B was permuted and the multiply
-      auto static const constexpr mask1 = (_MM_PERM_ENUM)_MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
-      atmp = _mm512_shuffle_epi32(*amat[i], mask1);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[1]);
-
-      // Multiply 2: //Shuffle A in the same way as B was permuted and the multiply
-      auto static const constexpr mask2 = (_MM_PERM_ENUM)_MM_SHUFFLE(1,0,2,3);
-      atmp = _mm512_shuffle_epi32(*amat[i], mask2);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[2]);
-
-      // Multiply 3: //Shuffle A in the same way as B was permuted and the multiply
-      auto static const constexpr mask3 = (_MM_PERM_ENUM)_MM_SHUFFLE(0,1,3,2); // it's reversed because of being big endian
-      atmp = _mm512_shuffle_epi32(*amat[i], mask3);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[3]);
-
-      //Lane swap *amat[i] here:
-      laneSwappedA = _mm512_shuffle_i32x4(*amat[i], *amat[i], 0b0100'1110);
-
-      // Multiply 4
-      *res[i] = _mm512_dpbusds_epi32(*res[i], laneSwappedA, breord[4]);
-
-      // Multiply 5: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask1 = _MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask1);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[5]);
-
-      // Multiply 6: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask2 = _MM_SHUFFLE(1,0,2,3);
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask2);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[6]);
-
-      // Multiply 7: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask3 = _MM_SHUFFLE(0,1,3,2); // it's reversed because of being big endian
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask3);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[7]);
-
-      //Lane swap *amat[i] here:
-      laneSwappedA = _mm512_shuffle_i32x4(*amat[i], *amat[i], 0b0001'1011);
-
-      // Multiply 8
-      *res[i] = _mm512_dpbusds_epi32(*res[i], laneSwappedA, breord[8]);
-
-      // Multiply 9: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask1 = _MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask1);
-      *res[i] = _mm512_dpbusds_epi32 (*res[i], atmp, breord[9]);
-
-      // Multiply 10: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask2 = _MM_SHUFFLE(1,0,2,3);
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask2);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[10]);
-
-      // Multiply 11: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask3 = _MM_SHUFFLE(0,1,3,2); // it's reversed because of being big endian
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask3);
-      *res[i] = _mm512_dpbusds_epi32 (*res[i], atmp, breord[11]);
-
-      //Lane swap *amat[i] here:
-      laneSwappedA = _mm512_shuffle_i32x4(*amat[i], *amat[i], 0b1011'0001);
-
-      // Multiply 12
-      *res[i] = _mm512_dpbusds_epi32(*res[i], laneSwappedA, breord[12]);
-
-      // Multiply 13: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask1 = _MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask1);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[13]);
-
-      // Multiply 14: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask2 = _MM_SHUFFLE(1,0,2,3);
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask2);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[14]);
-
-      // Multiply 15: //Shuffle A in the same way as B was permuted and the multiply
-      // auto static const constexpr mask3 = _MM_SHUFFLE(0,1,3,2); // it's reversed because of being big endian
-      atmp = _mm512_shuffle_epi32(laneSwappedA, mask3);
-      *res[i] = _mm512_dpbusds_epi32(*res[i], atmp, breord[15]);
+      multiplyRowSeqWrite(*amat[i], breord, *res[i]);
     }
   }
 
   __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
     /****** Important: C is assumed to be set to 0 ******/
-    typedef __m512i Register;
-    static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
-    static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
-    const Register * breord = reinterpret_cast<const Register *>(B);
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // Computes only the C tiles in rows [rowBegin, rowEnd) and columns [colBegin, colEnd), and of those only the part of the
+  // sum that comes from [kBegin, kEnd) of the width. The row and column bounds need to be multiples of numregs, the width bounds
+  // multiples of regwidth. Blocks that don't overlap in C can run on different threads without locking, and consecutive width
+  // ranges of the same block add up to the full product since C is accumulated into.
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*4*(width/numregs); // Skip the column blocks to the left of ours
     const Register * amat[numregs];
     Register * cres[numregs];
     // t is used to iterate over columns of A (A is left to right (sizeof(__m128i)) at a time))
-    for (size_t j = 0; j < colsB; j += numregs) { // 32/4=8
+    for (size_t j = colBegin; j < colEnd; j += numregs) { // 64/4=16
       // Loop breadth first of B, depth first of C. We write C one column (sizeof(__m128i)) at a time
-      for (size_t i = 0; i < rowsA; i += numregs) { // 32/4=8
-        const Register *  breord_cur = breord;
-        for (size_t t = 0; t < width; t += regwidth) { // Loop over the width so we only ever write to a set of 4 consecutive registers
+      for (size_t i = rowBegin; i < rowEnd; i += numregs) { // 64/4=16
+        const Register *  breord_cur = breord + (kBegin/regwidth)*numregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) { // Loop over the width so we only ever write to a set of 4 consecutive registers
           // Loop over rows of A, going to use the same tile of B
           for (size_t n = 0; n < numregs; n++) { // Read in from the memory @TODO kpu unordered_unfurl? Could also use pragma unroll but it's compiler dependent...
             amat[n] = reinterpret_cast<const Register *>(A + (i+n)*width + t);
             cres[n] = reinterpret_cast<Register *>(C + (i+n)*colsB + j);
           }
           multiplyTileSeqWrite(amat, breord_cur, cres);
-          breord_cur = breord_cur + numregs; // 32/4=8
+          breord_cur = breord_cur + numregs; // 64/4=16
+        }
+      }
+      breord = breord + 4*(width/numregs); // Our B reordered matrix goes over the colums first and rows later. Divided by 4 since we use 4 registers
+    }
+  }
+  struct runner {
+    using gemm = depthfirstaddrlooptileloopwritedependWith<Accumulate>;
+    using prepareB = bftile::mm512::depthfirst;
+  };
+
+};
+typedef depthfirstaddrlooptileloopwritedependWith<Saturating> depthfirstaddrlooptileloopwritedepend;
+
+// depthfirstaddrlooptileloopwritedepend without the pointer arrays. multiplyTileSeqWrite reads and writes the C tile through
+// memory on every step of the width, and the driver fills amat[] and cres[] again for every step. Here SubRows rows of the C tile
+// are loaded into registers, accumulated in them over the whole [kBegin, kEnd) and stored once at the end.
+// 16 accumulators, A, the two temporaries and whatever registers of B the compiler keeps around only just fit in the 32 zmm
+// registers, so by default the 16 rows are done as two sub tiles of 8, which leaves room. The B tile is then read once per
+// sub tile, from L1.
+// Same contract as depthfirstaddrlooptileloopwritedepend::gemmBlock.
+template<size_t SubRows = 8, class Accumulate = Saturating>
+struct registeraccumulated {
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+  static_assert(numregs % SubRows == 0, "SubRows has to divide the rows of a tile");
+
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    const size_t tiles = width/regwidth;
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*numregs; // Skip the column blocks to the left of ours
+    Register cres[SubRows];
+    for (size_t j = colBegin; j < colEnd; j += numregs) {
+      for (size_t i = rowBegin; i < rowEnd; i += SubRows) {
+        for (size_t n = 0; n < SubRows; n++) {
+          cres[n] = *reinterpret_cast<const Register *>(C + (i+n)*colsB + j);
+        }
+        const Register * breord_cur = breord + (kBegin/regwidth)*numregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) {
+          for (size_t n = 0; n < SubRows; n++) {
+            depthfirstaddrlooptileloopwritedependWith<Accumulate>::multiplyRowSeqWrite(*reinterpret_cast<const Register *>(A + (i+n)*width + t),
+                                                                                      breord_cur, cres[n]);
+          }
+          breord_cur = breord_cur + numregs;
+        }
+        for (size_t n = 0; n < SubRows; n++) {
+          *reinterpret_cast<Register *>(C + (i+n)*colsB + j) = cres[n];
         }
       }
-      breord = breord + 4*(width/numregs); // Our B reordered matrix goes over the colums first and rows later. Divided by 4 since we use 4 registers @TODO this is not quite right
+      breord = breord + tiles*numregs;
     }
   }
+
   struct runner {
-    using gemm = bftile::mm512::depthfirstaddrlooptileloopwritedepend;
+    using gemm = registeraccumulated<SubRows, Accumulate>;
     using prepareB = bftile::mm512::depthfirst;
   };
+};
+
+// registeraccumulated with software prefetching. Every column block of the reordered B is a separate stream tiles*numregs
+// registers away from the last, and every row of A is width bytes away from the next, which are jumps the hardware prefetcher
+// is slow to pick up on wide matrices. Distance steps of the width ahead of where the multiplication is, the B tile and the
+// part of every A row of the sub tile are prefetched into L1. Distance 0 turns prefetching off.
+// With StreamC, C is written with streaming stores and not read at all: C = A*B instead of C += A*B, for a C nobody is going to
+// read soon after. That only works when every block covers the whole width, so gemmBlock throws on anything less and
+// overwritesC keeps it out of blocked<> at compile time. _mm512_stream_si512 needs C 64-byte aligned.
+template<size_t Distance, bool StreamC = false, size_t SubRows = 8, class Accumulate = Saturating>
+struct prefetched {
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+  static_assert(numregs % SubRows == 0, "SubRows has to divide the rows of a tile");
+  static const constexpr bool overwritesC = StreamC; // C = A*B rather than C += A*B, see blocked<>
 
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0, unless StreamC ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    if (StreamC && (kBegin != 0 || kEnd != width)) {
+      throw std::invalid_argument("prefetched with StreamC overwrites C, so every block has to cover the whole width");
+    }
+    const size_t tiles = width/regwidth;
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*numregs; // Skip the column blocks to the left of ours
+    Register cres[SubRows];
+    for (size_t j = colBegin; j < colEnd; j += numregs) {
+      for (size_t i = rowBegin; i < rowEnd; i += SubRows) {
+        for (size_t n = 0; n < SubRows; n++) {
+          cres[n] = StreamC ? _mm512_setzero_si512() : *reinterpret_cast<const Register *>(C + (i+n)*colsB + j);
+        }
+        const Register * breord_cur = breord + (kBegin/regwidth)*numregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) {
+          if (Distance) { // Prefetches don't fault, so running off the end of A or B is harmless
+            for (size_t k = 0; k < numregs; k++) {
+              _mm_prefetch(reinterpret_cast<const char *>(breord_cur + Distance*numregs + k), _MM_HINT_T0);
+            }
+            for (size_t n = 0; n < SubRows; n++) {
+              _mm_prefetch(reinterpret_cast<const char *>(A + (i+n)*width + t + Distance*regwidth), _MM_HINT_T0);
+            }
+          }
+          for (size_t n = 0; n < SubRows; n++) {
+            depthfirstaddrlooptileloopwritedependWith<Accumulate>::multiplyRowSeqWrite(*reinterpret_cast<const Register *>(A + (i+n)*width + t),
+                                                                                      breord_cur, cres[n]);
+          }
+          breord_cur = breord_cur + numregs;
+        }
+        for (size_t n = 0; n < SubRows; n++) {
+          if (StreamC) {
+            _mm512_stream_si512(reinterpret_cast<Register *>(C + (i+n)*colsB + j), cres[n]);
+          } else {
+            *reinterpret_cast<Register *>(C + (i+n)*colsB + j) = cres[n];
+          }
+        }
+      }
+      breord = breord + tiles*numregs;
+    }
+    if (StreamC) {
+      _mm_sfence(); // Streaming stores are weakly ordered, make sure they are all visible before anyone reads C
+    }
+  }
+
+  struct runner {
+    using gemm = prefetched<Distance, StreamC, SubRows, Accumulate>;
+    using prepareB = bftile::mm512::depthfirst;
+  };
 };
 
+// Register blocked variant of depthfirstaddrlooptileloopwritedepend. The tile of B is loaded into registers once per step of the
+// width and then RowGroups groups of numregs rows of A are streamed through it, instead of reloading the tile for every group.
+// The B tile takes 16 zmm registers and a row needs 4 more (A, two temporaries and C), so everything fits in the 32 we have.
+template<size_t RowGroups, class Accumulate = Saturating>
+struct registerblocked {
+  static_assert(RowGroups >= 1 && RowGroups <= 4, "Between 1 and 4 row groups share one B tile");
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // Same contract as depthfirstaddrlooptileloopwritedepend::gemmBlock
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*4*(width/numregs);
+    Register btile[numregs];
+    for (size_t j = colBegin; j < colEnd; j += numregs) { // 64/4=16
+      for (size_t i = rowBegin; i < rowEnd; i += numregs*RowGroups) {
+        const size_t rows = rowEnd - i < numregs*RowGroups ? rowEnd - i : numregs*RowGroups; // The last block may have fewer groups
+        const Register * breord_cur = breord + (kBegin/regwidth)*numregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) {
+          for (size_t k = 0; k < numregs; k++) {
+            btile[k] = breord_cur[k];
+          }
+          for (size_t n = 0; n < rows; n++) {
+            const Register * amat = reinterpret_cast<const Register *>(A + (i+n)*width + t);
+            Register * cres = reinterpret_cast<Register *>(C + (i+n)*colsB + j);
+            depthfirstaddrlooptileloopwritedependWith<Accumulate>::multiplyRowSeqWrite(*amat, btile, *cres);
+          }
+          breord_cur = breord_cur + numregs; // 64/4=16
+        }
+      }
+      breord = breord + 4*(width/numregs); // Next column block
+    }
+  }
+
+  struct runner {
+    using gemm = bftile::mm512::registerblocked<RowGroups, Accumulate>;
+    using prepareB = bftile::mm512::depthfirst;
+  };
+};
+
+// Any shape: rowsA, width and colsB don't need to be multiples of anything. B is zero padded to whole tiles when it is
+// reordered, the edges of A are read with masked loads that zero the bytes past the end of a row, and the edges of C are
+// read and written with masked loads and stores. Rows of A past the end are skipped entirely instead of being multiplied by
+// padding. The C tile is accumulated in registers over the whole width and written to memory once.
+template<class Accumulate>
+struct anyshapeWith {
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+  static const constexpr uint32_t registerBits = 8*sizeof(Register); // What the prepared B looks like, for serialize.h
+  static const constexpr PreparedLayout layout = PreparedLayout::anyshape;
+
+  // Masks selecting the first n elements, n may be larger than the register
+  static inline __mmask64 byteMask(size_t n) {
+    return n >= regwidth ? (__mmask64)-1 : (__mmask64)(((__mmask64)1 << n) - 1);
+  }
+
+  static inline __mmask16 columnMask(size_t n) {
+    return n >= numregs ? (__mmask16)((1u << numregs) - 1) : (__mmask16)((1u << n) - 1);
+  }
+
+  // Number of tiles of B in one column block, the last one is zero padded
+  static inline size_t tilesPerColumn(size_t rowsB) {
+    return (rowsB + regwidth - 1)/regwidth;
+  }
+
+  // Size in bytes of the reordered B, including the padding
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return tilesPerColumn(rowsB)*((colsB + numregs - 1)/numregs)*numregs*regwidth;
+  }
+
+  static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    prepareBMatrixBlock(in, out, rowsB, colsB, 0, colsB);
+  }
+
+  // Only the column blocks in [colBegin, colEnd), like depthfirst::prepareBMatrixBlock
+  static void prepareBMatrixBlock(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB, size_t colBegin, size_t colEnd) {
+    // Same traversal as depthfirst, except that the tiles on the bottom and right edges are zero padded
+    Register* outmat = reinterpret_cast<Register*>(out) + (colBegin/numregs)*tilesPerColumn(rowsB)*numregs;
+    const bool stream = streamPrepared(out, preparedSize(rowsB, colsB), regwidth);
+    Register intile[numregs];
+    Register outtile[numregs];
+    for (size_t i = colBegin; i < colEnd; i += numregs) {
+      for (size_t j = 0; j < rowsB; j += regwidth) {
+        __mmask64 rowmask = byteMask(rowsB - j);
+        for (size_t t = 0; t < numregs; t++) {
+          intile[t] = i + t < colsB ? _mm512_maskz_loadu_epi8(rowmask, &in[(i + t)*rowsB + j]) : _mm512_setzero_si512();
+        }
+        prepareBtile(intile, outtile);
+        storeTile(outtile, outmat, stream);
+        outmat = outmat + numregs;
+      }
+    }
+    if (stream) {
+      _mm_sfence(); // Streaming stores are weakly ordered, make sure they are all visible before anyone reads the matrix
+    }
+  }
+
+
+  // Also writes the colsB column sum corrections that gemmShifted needs for a signed A
+  static void prepareBMatrix(const int8_t * in, int8_t * out, int32_t * correction, size_t rowsB, size_t colsB) {
+    prepareBMatrix(in, out, rowsB, colsB);
+    prepareShiftCorrection(in, correction, rowsB, colsB);
+  }
+
+  // One register of a row of A, zero past the end of the row and with the sign bits flipped when the epilogue says A is signed
+  template<class Epilogue>
+  static inline Register loadA(__mmask64 amask, const uint8_t * a) {
+    const Register row = _mm512_maskz_loadu_epi8(amask, a);
+    return Epilogue::shiftA ? flipSign(row) : row;
+  }
+
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // C is whatever the epilogue (see epilogue.h) makes of the product, for example dequantized floats
+  template<class Epilogue>
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    gemmBlock(A, B, width, colsB, 0, rowsA, 0, colsB, 0, width, epilogue);
+  }
+
+  // Signed int8 A, with the correction from prepareBMatrix above. The result is exact, see ShiftedA.
+  static void gemmShifted(const int8_t * A, const int8_t * B, const int32_t * correction, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemm(reinterpret_cast<const uint8_t *>(A), B, rowsA, width, colsB, shiftedA(correction, AccumulateC(C, colsB)));
+  }
+
+  // Same contract as depthfirstaddrlooptileloopwritedepend::gemmBlock, except that rowEnd, colEnd and kEnd may also be the
+  // ragged edge of the matrix.
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    gemmBlock(A, B, width, colsB, rowBegin, rowEnd, colBegin, colEnd, kBegin, kEnd, AccumulateC(C, colsB));
+  }
+
+  // The epilogue sets up every row of a C tile before the multiply-adds over [kBegin, kEnd) and gets it back afterwards
+  template<class Epilogue>
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, size_t width, size_t, size_t rowBegin,
+                                                 size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    const size_t tiles = tilesPerColumn(width);
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*numregs;
+    Register cres[numregs];
+    for (size_t j = colBegin; j < colEnd; j += numregs) { // 64/4=16
+      const __mmask16 colmask = columnMask(colEnd - j);
+      for (size_t i = rowBegin; i < rowEnd; i += numregs) { // 64/4=16
+        const size_t rows = rowEnd - i < numregs ? rowEnd - i : numregs;
+        for (size_t n = 0; n < rows; n++) {
+          epilogue.init(cres[n], i+n, j, colmask);
+        }
+        const Register * breord_cur = breord + (kBegin/regwidth)*numregs;
+        for (size_t t = kBegin; t < kEnd; t += regwidth) {
+          const __mmask64 amask = byteMask(width - t);
+          for (size_t n = 0; n < rows; n++) {
+            depthfirstaddrlooptileloopwritedependWith<Accumulate>::multiplyRowSeqWrite(loadA<Epilogue>(amask, A + (i+n)*width + t), breord_cur, cres[n]);
+          }
+          breord_cur = breord_cur + numregs; // 64/4=16
+        }
+        for (size_t n = 0; n < rows; n++) {
+          epilogue.finish(cres[n], i+n, j, colmask);
+        }
+      }
+      breord = breord + tiles*numregs;
+    }
+  }
+
+  struct runner {
+    using gemm = anyshapeWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct anyshape
+typedef anyshapeWith<Saturating> anyshape;
+
+// Packed A: the copies of A that multiplyRowSeqWrite makes with shuffles and lane swaps are made once, ahead of the
+// multiplication, instead of once for every column block of B. Every register of A turns into numregs registers, one per
+// register of the B tile, so the inner loop is nothing but loads and dpbusds. This pays off when colsB spans more than one
+// column block, at the cost of a packed A that is numregs times the size of A.
+// B is prepared exactly as for anyshape and any shape goes.
+template<class Accumulate>
+struct packedAWith {
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+
+  // The numregs permutations of one register of A, in the order of the registers of a prepared B tile. These are the same
+  // shuffles and lane swaps multiplyRowSeqWrite does on the fly.
+  static inline void permuteRow(const __m512i a, __m512i * out) {
+    auto static const constexpr mask1 = (_MM_PERM_ENUM)_MM_SHUFFLE(2,3,0,1); // it's reversed because of being big endian
+    auto static const constexpr mask2 = (_MM_PERM_ENUM)_MM_SHUFFLE(1,0,2,3);
+    auto static const constexpr mask3 = (_MM_PERM_ENUM)_MM_SHUFFLE(0,1,3,2);
+    const __m512i lanes[4] = {a,
+                              _mm512_shuffle_i32x4(a, a, 0b0100'1110),
+                              _mm512_shuffle_i32x4(a, a, 0b0001'1011),
+                              _mm512_shuffle_i32x4(a, a, 0b1011'0001)};
+    for (int l = 0; l < 4; l++) {
+      out[4*l]     = lanes[l];
+      out[4*l + 1] = _mm512_shuffle_epi32(lanes[l], mask1);
+      out[4*l + 2] = _mm512_shuffle_epi32(lanes[l], mask2);
+      out[4*l + 3] = _mm512_shuffle_epi32(lanes[l], mask3);
+    }
+  }
+
+  // Size in bytes of the packed A. Rows are padded to whole row blocks and the width to whole registers
+  static size_t packedSize(size_t rowsA, size_t width) {
+    return ((rowsA + numregs - 1)/numregs)*anyshapeWith<Accumulate>::tilesPerColumn(width)*numregs*numregs*regwidth;
+  }
+
+  // Packs the rows [rowBegin, rowEnd), at most numregs of them, and the part [kBegin, kEnd) of the width into one panel. For every
+  // register along the width the panel holds the permutations of row 0, then those of row 1 and so on. Missing rows are zero.
+  // With shiftA, A is signed and gets its sign bits flipped on the way (see ShiftedA).
+  static void packPanel(const uint8_t * A, Register * panel, size_t width, size_t rowBegin, size_t rowEnd, size_t kBegin, size_t kEnd,
+                        bool shiftA) {
+    const size_t rows = rowEnd - rowBegin;
+    for (size_t t = kBegin; t < kEnd; t += regwidth) {
+      const __mmask64 amask = anyshapeWith<Accumulate>::byteMask(width - t);
+      for (size_t n = 0; n < numregs; n++) {
+        Register row = n < rows ? _mm512_maskz_loadu_epi8(amask, A + (rowBegin+n)*width + t) : _mm512_setzero_si512();
+        permuteRow(shiftA ? flipSign(row) : row, panel);
+        panel = panel + numregs;
+      }
+    }
+  }
+
+  // A signed A, to be multiplied with a ShiftedA epilogue, needs shiftA
+  static void prepareAMatrix(const uint8_t * in, uint8_t * out, size_t rowsA, size_t width, bool shiftA = false) {
+    Register * outmat = reinterpret_cast<Register *>(out);
+    const size_t panelSize = anyshapeWith<Accumulate>::tilesPerColumn(width)*numregs*numregs;
+    for (size_t i = 0; i < rowsA; i += numregs) {
+      packPanel(in, outmat, width, i, rowsA - i < numregs ? rowsA : i + numregs, 0, width, shiftA);
+      outmat = outmat + panelSize;
+    }
+  }
+
+  // Rows x ColBlocks tiles of C at once. Every permutation of A that is loaded goes into ColBlocks dpbusds, one per column
+  // block, so there are only 1 + 1/ColBlocks loads per dpbusds. apanel and breord point at the first row and the first
+  // column block, at the tile where [kBegin, kEnd) starts. Column blocks are tileStride registers apart in the reordered B.
+  // row and col are the position of the micro tile in C.
+  template<size_t Rows, size_t ColBlocks, class Epilogue>
+  static inline void multiplyMicroTile(const Register * apanel, const Register * breord, size_t tileStride, size_t row, size_t col,
+                                       const __mmask16 * colmasks, size_t tilesK, const Epilogue &epilogue) {
+    Register cres[Rows][ColBlocks];
+    for (size_t n = 0; n < Rows; n++) {
+      for (size_t b = 0; b < ColBlocks; b++) {
+        epilogue.init(cres[n][b], row + n, col + b*numregs, colmasks[b]);
+      }
+    }
+    for (size_t t = 0; t < tilesK; t++) {
+      for (size_t n = 0; n < Rows; n++) {
+        for (size_t k = 0; k < numregs; k++) {
+          const Register a = apanel[n*numregs + k];
+          for (size_t b = 0; b < ColBlocks; b++) {
+            cres[n][b] = Accumulate::dot(cres[n][b], a, breord[b*tileStride + k]);
+          }
+        }
+      }
+      apanel = apanel + numregs*numregs;
+      breord = breord + numregs; // 64/4=16
+    }
+    for (size_t n = 0; n < Rows; n++) {
+      for (size_t b = 0; b < ColBlocks; b++) {
+        epilogue.finish(cres[n][b], row + n, col + b*numregs, colmasks[b]);
+      }
+    }
+  }
+
+  // Micro tiles of rowsPerStep x colBlocksPerStep take 16 of the 32 registers. The rows and column blocks left over at the edges
+  // are done by smaller micro tiles.
+  static const constexpr size_t rowsPerStep = 4;
+  static const constexpr size_t colBlocksPerStep = 4;
+
+  template<size_t ColBlocks, class Epilogue>
+  static inline void multiplyPanelColumns(const Register * apanel, const Register * breord, size_t tileStride, size_t row, size_t col,
+                                          const __mmask16 * colmasks, size_t rows, size_t tilesK, const Epilogue &epilogue) {
+    size_t n = 0;
+    for (; n + rowsPerStep <= rows; n += rowsPerStep) {
+      multiplyMicroTile<rowsPerStep, ColBlocks>(apanel + n*numregs, breord, tileStride, row + n, col, colmasks, tilesK, epilogue);
+    }
+    for (; n < rows; n++) {
+      multiplyMicroTile<1, ColBlocks>(apanel + n*numregs, breord, tileStride, row + n, col, colmasks, tilesK, epilogue);
+    }
+  }
+
+  // The rows [i, i + rows) of C against the columns [colBegin, colEnd), from the panel of A covering [kBegin, kEnd) of the width
+  template<class Epilogue>
+  __attribute__((flatten)) static void multiplyPanel(const Register * panel, const int8_t * B, size_t width, size_t i, size_t rows,
+                                                     size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    const size_t tiles = anyshapeWith<Accumulate>::tilesPerColumn(width);
+    const size_t tilesK = (kEnd - kBegin + regwidth - 1)/regwidth;
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*numregs + (kBegin/regwidth)*numregs;
+    __mmask16 colmasks[colBlocksPerStep];
+    size_t j = colBegin;
+    for (; j + colBlocksPerStep*numregs <= colEnd; j += colBlocksPerStep*numregs) {
+      for (size_t b = 0; b < colBlocksPerStep; b++) {
+        colmasks[b] = anyshapeWith<Accumulate>::columnMask(colEnd - j - b*numregs);
+      }
+      multiplyPanelColumns<colBlocksPerStep>(panel, breord, tiles*numregs, i, j, colmasks, rows, tilesK, epilogue);
+      breord = breord + colBlocksPerStep*tiles*numregs;
+    }
+    for (; j < colEnd; j += numregs) {
+      colmasks[0] = anyshapeWith<Accumulate>::columnMask(colEnd - j);
+      multiplyPanelColumns<1>(panel, breord, tiles*numregs, i, j, colmasks, rows, tilesK, epilogue);
+      breord = breord + tiles*numregs;
+    }
+  }
+
+  // A packed by prepareAMatrix against B prepared by anyshape. Worth it when the same A is multiplied by more than one B.
+  static void gemmPacked(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmPacked(A, B, rowsA, width, colsB, AccumulateC(C, colsB));
+  }
+
+  template<class Epilogue>
+  static void gemmPacked(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    const Register * panel = reinterpret_cast<const Register *>(A);
+    const size_t panelSize = anyshapeWith<Accumulate>::tilesPerColumn(width)*numregs*numregs;
+    for (size_t i = 0; i < rowsA; i += numregs) {
+      multiplyPanel(panel, B, width, i, rowsA - i < numregs ? rowsA - i : numregs, 0, colsB, 0, width, epilogue);
+      panel = panel + panelSize;
+    }
+  }
+
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // C is whatever the epilogue (see epilogue.h) makes of the product
+  template<class Epilogue>
+  static void gemm(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    gemmBlock(A, B, width, colsB, 0, rowsA, 0, colsB, 0, width, epilogue);
+  }
+
+  // Same contract as anyshape::gemmBlock. Every block of numregs rows is packed into a scratch panel as it comes up and then
+  // multiplied by all the column blocks, so the panel only needs to hold [kBegin, kEnd) of the width. The panel is the calling
+  // thread's threadScratch, so repeated calls reuse it.
+  static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                        size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    gemmBlock(A, B, width, colsB, rowBegin, rowEnd, colBegin, colEnd, kBegin, kEnd, AccumulateC(C, colsB));
+  }
+
+  template<class Epilogue>
+  static void gemmBlock(const uint8_t * A, const int8_t * B, size_t width, size_t, size_t rowBegin, size_t rowEnd,
+                        size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    Register * panel = static_cast<Register *>(threadScratch(((kEnd - kBegin + regwidth - 1)/regwidth)*numregs*numregs*regwidth));
+    for (size_t i = rowBegin; i < rowEnd; i += numregs) {
+      const size_t rows = rowEnd - i < numregs ? rowEnd - i : numregs;
+      packPanel(A, panel, width, i, i + rows, kBegin, kEnd, Epilogue::shiftA);
+      multiplyPanel(panel, B, width, i, rows, colBegin, colEnd, kBegin, kEnd, epilogue);
+    }
+  }
+
+  struct runner {
+    using gemm = packedAWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct packedA
+typedef packedAWith<Saturating> packedA;
+
+// Skinny A, a handful of rows as in a decoder that translates one sentence at a time. anyshape spends 15 permutes of A on every
+// 16 dpbusds, for every column block of B, and packedA packs a whole block of numregs rows to use only one of them. Here each
+// register of A is permuted once and the permutations go into colBlocksPerStep column blocks, so what is left is the dpbusds
+// and streaming B in from memory, which is what limits a gemv. Every byte of B is read exactly once.
+// B is prepared by anyshape, which is the same as a depthfirst prepared B when the shape is a multiple of the tile. More than
+// maxRows rows are done maxRows at a time, but from there on anyshape and packedA are the faster choice.
+template<class Accumulate>
+struct gemvWith {
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+
+  // maxRows x colBlocksPerStep = 12 accumulators plus the numregs = 16 permutations of one row of A leave 4 of the 32 registers
+  // for the row of A being permuted and for B. 4 column blocks would take all 32 before the first register of B.
+  static const constexpr size_t maxRows = 4;
+  static const constexpr size_t colBlocksPerStep = 3;
+
+  // Rows x ColBlocks tiles of C over [kBegin, kEnd) of the width. breord points at the first column block, at the tile where
+  // kBegin is, and column blocks are tileStride registers apart.
+  template<size_t Rows, size_t ColBlocks, class Epilogue>
+  static inline void multiplyStrip(const uint8_t * A, const Register * breord, size_t tileStride, size_t width, size_t row, size_t col,
+                                   const __mmask16 * colmasks, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    Register cres[Rows][ColBlocks];
+    for (size_t n = 0; n < Rows; n++) {
+      for (size_t b = 0; b < ColBlocks; b++) {
+        epilogue.init(cres[n][b], row + n, col + b*numregs, colmasks[b]);
+      }
+    }
+    Register permuted[numregs];
+    for (size_t t = kBegin; t < kEnd; t += regwidth) {
+      const __mmask64 amask = anyshapeWith<Accumulate>::byteMask(width - t);
+      for (size_t n = 0; n < Rows; n++) {
+        packedAWith<Accumulate>::permuteRow(anyshapeWith<Accumulate>::template loadA<Epilogue>(amask, A + (row + n)*width + t), permuted);
+        for (size_t k = 0; k < numregs; k++) {
+          for (size_t b = 0; b < ColBlocks; b++) {
+            cres[n][b] = Accumulate::dot(cres[n][b], permuted[k], breord[b*tileStride + k]);
+          }
+        }
+      }
+      breord = breord + numregs; // 64/4=16
+    }
+    for (size_t n = 0; n < Rows; n++) {
+      for (size_t b = 0; b < ColBlocks; b++) {
+        epilogue.finish(cres[n][b], row + n, col + b*numregs, colmasks[b]);
+      }
+    }
+  }
+
+  // The rows [row, row + Rows) of C against the columns [colBegin, colEnd)
+  template<size_t Rows, class Epilogue>
+  static void multiplyRows(const uint8_t * A, const int8_t * B, size_t width, size_t row, size_t colBegin, size_t colEnd,
+                           size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    const size_t tiles = anyshapeWith<Accumulate>::tilesPerColumn(width);
+    const Register * breord = reinterpret_cast<const Register *>(B) + (colBegin/numregs)*tiles*numregs + (kBegin/regwidth)*numregs;
+    __mmask16 colmasks[colBlocksPerStep];
+    size_t j = colBegin;
+    for (; j + colBlocksPerStep*numregs <= colEnd; j += colBlocksPerStep*numregs) {
+      for (size_t b = 0; b < colBlocksPerStep; b++) {
+        colmasks[b] = anyshapeWith<Accumulate>::columnMask(colEnd - j - b*numregs);
+      }
+      multiplyStrip<Rows, colBlocksPerStep>(A, breord, tiles*numregs, width, row, j, colmasks, kBegin, kEnd, epilogue);
+      breord = breord + colBlocksPerStep*tiles*numregs;
+    }
+    for (; j < colEnd; j += numregs) {
+      colmasks[0] = anyshapeWith<Accumulate>::columnMask(colEnd - j);
+      multiplyStrip<Rows, 1>(A, breord, tiles*numregs, width, row, j, colmasks, kBegin, kEnd, epilogue);
+      breord = breord + tiles*numregs;
+    }
+  }
+
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // C is whatever the epilogue (see epilogue.h) makes of the product
+  template<class Epilogue>
+  static void gemm(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    gemmBlock(A, B, width, colsB, 0, rowsA, 0, colsB, 0, width, epilogue);
+  }
+
+  // Same contract as anyshape::gemmBlock
+  static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                        size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    gemmBlock(A, B, width, colsB, rowBegin, rowEnd, colBegin, colEnd, kBegin, kEnd, AccumulateC(C, colsB));
+  }
+
+  template<class Epilogue>
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, size_t width, size_t, size_t rowBegin, size_t rowEnd,
+                                                 size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    for (size_t i = rowBegin; i < rowEnd; i += maxRows) {
+      switch (rowEnd - i < maxRows ? rowEnd - i : maxRows) {
+        case 1: multiplyRows<1>(A, B, width, i, colBegin, colEnd, kBegin, kEnd, epilogue); break;
+        case 2: multiplyRows<2>(A, B, width, i, colBegin, colEnd, kBegin, kEnd, epilogue); break;
+        case 3: multiplyRows<3>(A, B, width, i, colBegin, colEnd, kBegin, kEnd, epilogue); break;
+        default: multiplyRows<maxRows>(A, B, width, i, colBegin, colEnd, kBegin, kEnd, epilogue); break;
+      }
+    }
+  }
+
+  struct runner {
+    using gemm = gemvWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct gemv
+typedef gemvWith<Saturating> gemv;
+
 } // namespace mm512
 } // namespace bftile
+
+BFTILE_TARGET_END
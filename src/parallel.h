@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include "epilogue.h"
+#include "threadpool.h"
+
+namespace bftile {
+/************************************************************************************ multithreaded driver ************************************************************************************/
+
+// Splits the tile loops of a runner over the threads of a ThreadPool. C is cut into a grid of rectangular blocks and every task
+// owns exactly one of them, so the threads never write to the same C tile and need no synchronisation apart from the final join.
+// The wrapped gemm needs to provide gemmBlock() and numregs (see depthfirstaddrlooptileloopwritedepend). Ragged edges are
+// passed through to gemmBlock as they are, so they only work with kernels that support them (see anyshape).
+template<class Runner>
+struct parallel {
+  typedef typename Runner::gemm Kernel;
+
+  // Below this many multiply-adds per thread waking up the pool costs more than it saves
+  static const constexpr size_t minWorkPerThread = 1 << 20;
+
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    gemm(A, B, C, rowsA, width, colsB, ThreadPool::instance());
+  }
+
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB, ThreadPool &pool) {
+    /****** Important: C is assumed to be set to 0 ******/
+    forEachBlock(rowsA, width, colsB, pool, [&](size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd) {
+      Kernel::gemmBlock(A, B, C, width, colsB, rowBegin, rowEnd, colBegin, colEnd, 0, width);
+    });
+  }
+
+  // With an epilogue (see epilogue.h), for kernels that support one. Every block covers the whole width, so the epilogue
+  // always sees complete sums.
+  template<class Epilogue>
+  static void gemm(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    gemm(A, B, rowsA, width, colsB, epilogue, ThreadPool::instance());
+  }
+
+  template<class Epilogue>
+  static void gemm(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue, ThreadPool &pool) {
+    forEachBlock(rowsA, width, colsB, pool, [&](size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd) {
+      Kernel::gemmBlock(A, B, width, colsB, rowBegin, rowEnd, colBegin, colEnd, 0, width, epilogue);
+    });
+  }
+
+  // Cuts C into blocks and calls block(rowBegin, rowEnd, colBegin, colEnd) for each of them on the pool
+  template<class Block>
+  static void forEachBlock(size_t rowsA, size_t width, size_t colsB, ThreadPool &pool, const Block &block) {
+    const size_t numregs = Kernel::numregs;
+    const size_t rowTiles = (rowsA + numregs - 1)/numregs;
+    const size_t colTiles = (colsB + numregs - 1)/numregs;
+    if (rowTiles == 0 || colTiles == 0) {
+      return;
+    }
+    size_t threads = std::min(pool.size(), std::max<size_t>((rowsA*width*colsB)/minWorkPerThread, 1));
+
+    // Prefer splitting the columns: each thread then only streams its own slice of the reordered B. Rows are only split when
+    // there are fewer column blocks than threads.
+    const size_t colParts = std::min(threads, colTiles);
+    const size_t rowParts = std::min(rowTiles, (threads + colParts - 1)/colParts);
+
+    pool.run(colParts*rowParts, [&](size_t task) {
+      size_t colPart = task % colParts;
+      size_t rowPart = task / colParts;
+      size_t colBegin = (colTiles*colPart/colParts)*numregs;
+      size_t colEnd = std::min((colTiles*(colPart + 1)/colParts)*numregs, colsB);
+      size_t rowBegin = (rowTiles*rowPart/rowParts)*numregs;
+      size_t rowEnd = std::min((rowTiles*(rowPart + 1)/rowParts)*numregs, rowsA);
+      block(rowBegin, rowEnd, colBegin, colEnd);
+    });
+  }
+
+  // Prepares B on the pool, each thread taking a contiguous range of column blocks. Needs a prepareB with prepareBMatrixBlock()
+  // (see depthfirst and anyshape).
+  struct prepareB {
+    typedef typename Runner::prepareB Serial;
+
+    // Below this many bytes of B per thread the copy is over before the pool has woken up
+    static const constexpr size_t minBytesPerThread = 1 << 18;
+
+    static size_t preparedSize(size_t rowsB, size_t colsB) {
+      return Serial::preparedSize(rowsB, colsB);
+    }
+
+    static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+      prepareBMatrix(in, out, rowsB, colsB, ThreadPool::instance());
+    }
+
+    static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB, ThreadPool &pool) {
+      const size_t numregs = Kernel::numregs;
+      const size_t colTiles = (colsB + numregs - 1)/numregs;
+      const size_t threads = std::min(std::min(pool.size(), colTiles), std::max<size_t>((rowsB*colsB)/minBytesPerThread, 1));
+      if (threads <= 1) {
+        Serial::prepareBMatrix(in, out, rowsB, colsB);
+        return;
+      }
+      pool.run(threads, [&](size_t task) {
+        size_t colBegin = (colTiles*task/threads)*numregs;
+        size_t colEnd = std::min((colTiles*(task + 1)/threads)*numregs, colsB);
+        Serial::prepareBMatrixBlock(in, out, rowsB, colsB, colBegin, colEnd);
+      });
+    }
+
+    // Along with the correction for a signed A (see ShiftedA)
+    static void prepareBMatrix(const int8_t * in, int8_t * out, int32_t * correction, size_t rowsB, size_t colsB) {
+      prepareBMatrix(in, out, rowsB, colsB);
+      prepareShiftCorrection(in, correction, rowsB, colsB);
+    }
+  };
+
+  struct runner {
+    using gemm = bftile::parallel<Runner>;
+    using prepareB = typename bftile::parallel<Runner>::prepareB;
+  };
+};
+
+} // namespace bftile
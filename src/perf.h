@@ -0,0 +1,240 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#ifdef BFTILE_PERF
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bftile {
+namespace perf {
+/************************************************************************************ hardware counters ************************************************************************************/
+// Optional hardware event counts around the kernels, through Linux perf_event_open. Build with -DBFTILE_PERF (cmake
+// -DBFTILE_PERF=ON) to get them. Without it enabled is false, Counters never opens anything, stats stay at zero and
+// instrumented<Runner>::runner is Runner itself, so there is nothing left to cost anything.
+//
+// Counters only count the thread that opened them, in user space: the workers of a parallel<> runner aren't included, and
+// neither is anything the kernel does for us, like page faults. Any event the machine or the permissions
+// (/proc/sys/kernel/perf_event_paranoid) don't allow is reported as unavailable instead of failing, so the same binary runs
+// in a VM without a PMU.
+//
+// L2 misses and dpbusds have no generic perf event and are read as raw events. L2 misses default to L2_RQSTS.MISS (event
+// 0x24, umask 0x3f) of the Intel cores that have VNNI. Intel has no event for dpbusds, so that one is only counted when
+// BFTILE_PERF_DPBUSDS holds a raw event config (in hex) that stands in for it on the machine at hand, like the uops of the
+// port the dpbusds issue on. BFTILE_PERF_L2 overrides the L2 event the same way.
+
+#ifdef BFTILE_PERF
+static const constexpr bool enabled = true;
+#else
+static const constexpr bool enabled = false;
+#endif
+
+enum Event {
+  cycles,
+  instructions,
+  l1dMisses,
+  l2Misses,
+  llcMisses,
+  dpbusds,
+  eventCount
+};
+
+inline const char * eventName(size_t event) {
+  static const char * names[eventCount] = {"cycles", "instructions", "l1d-misses", "l2-misses", "llc-misses", "dpbusds"};
+  return names[event];
+}
+
+// Counts over one or more calls. An event that couldn't be counted has available[event] == false and a value of 0.
+struct Stats {
+  uint64_t calls = 0;
+  uint64_t values[eventCount] = {0};
+  bool available[eventCount] = {false};
+
+  Stats &operator+=(const Stats &other) {
+    for (size_t event = 0; event < eventCount; event++) {
+      values[event] += other.values[event];
+      available[event] = (available[event] || !calls) && other.available[event];
+    }
+    calls += other.calls;
+    return *this;
+  }
+
+  // Average per call, 0 when there were no calls
+  double perCall(size_t event) const {
+    return calls ? static_cast<double>(values[event])/calls : 0;
+  }
+};
+
+// The counters of the calling thread. start() and stop() bracket what is to be counted, and stop() returns the counts since
+// start() as one call.
+class Counters {
+  public:
+#ifdef BFTILE_PERF
+    Counters() {
+      for (size_t event = 0; event < eventCount; event++) {
+        fds_[event] = -1;
+        uint32_t type;
+        uint64_t config;
+        if (eventConfig(event, type, config)) {
+          fds_[event] = open(type, config);
+        }
+      }
+    }
+
+    ~Counters() {
+      for (size_t event = 0; event < eventCount; event++) {
+        if (fds_[event] != -1) {
+          close(fds_[event]);
+        }
+      }
+    }
+
+    Counters(const Counters&) = delete;
+    Counters& operator=(const Counters&) = delete;
+
+    void start() {
+      for (size_t event = 0; event < eventCount; event++) {
+        if (fds_[event] != -1) {
+          ioctl(fds_[event], PERF_EVENT_IOC_RESET, 0);
+          ioctl(fds_[event], PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+    }
+
+    Stats stop() {
+      Stats stats;
+      for (size_t event = 0; event < eventCount; event++) {
+        if (fds_[event] != -1) {
+          ioctl(fds_[event], PERF_EVENT_IOC_DISABLE, 0);
+        }
+      }
+      for (size_t event = 0; event < eventCount; event++) {
+        uint64_t value;
+        if (fds_[event] != -1 && read(fds_[event], &value, sizeof(value)) == sizeof(value)) {
+          stats.values[event] = value;
+          stats.available[event] = true;
+        }
+      }
+      stats.calls = 1;
+      return stats;
+    }
+
+    bool available(size_t event) const { return fds_[event] != -1; }
+
+  private:
+    static bool eventConfig(size_t event, uint32_t &type, uint64_t &config) {
+      switch (event) {
+        case cycles:
+          type = PERF_TYPE_HARDWARE;
+          config = PERF_COUNT_HW_CPU_CYCLES;
+          return true;
+        case instructions:
+          type = PERF_TYPE_HARDWARE;
+          config = PERF_COUNT_HW_INSTRUCTIONS;
+          return true;
+        case l1dMisses:
+          type = PERF_TYPE_HW_CACHE;
+          config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+          return true;
+        case l2Misses:
+          type = PERF_TYPE_RAW;
+          return rawConfig("BFTILE_PERF_L2", 0x3f24, config);
+        case llcMisses:
+          type = PERF_TYPE_HW_CACHE;
+          config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+          return true;
+        case dpbusds:
+          type = PERF_TYPE_RAW;
+          return rawConfig("BFTILE_PERF_DPBUSDS", 0, config);
+        default:
+          return false;
+      }
+    }
+
+    // A raw event config from the environment variable name, or fallback when it isn't set. 0 means don't count.
+    static bool rawConfig(const char * name, uint64_t fallback, uint64_t &config) {
+      const char * value = std::getenv(name);
+      config = value ? std::strtoull(value, nullptr, 16) : fallback;
+      return config != 0;
+    }
+
+    static int open(uint32_t type, uint64_t config) {
+      struct perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1; // Allowed up to perf_event_paranoid 2, and the kernel's work isn't ours anyway
+      attr.exclude_hv = 1;
+      return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)); // This thread, any CPU
+    }
+
+    int fds_[eventCount];
+#else
+    void start() {}
+    Stats stop() { return Stats(); }
+    bool available(size_t) const { return false; }
+#endif
+};
+
+// The counters of the calling thread, opened on first use
+inline Counters &threadCounters() {
+  static thread_local Counters counters;
+  return counters;
+}
+
+// Counts of every gemm and prepareBMatrix that went through an instrumented runner, summed over all calls since the last reset
+inline Stats &gemmStats() {
+  static Stats stats;
+  return stats;
+}
+
+inline Stats &prepareStats() {
+  static Stats stats;
+  return stats;
+}
+
+inline void resetStats() {
+  gemmStats() = Stats();
+  prepareStats() = Stats();
+}
+
+// Runner with every gemm and prepareBMatrix counted into gemmStats() and prepareStats(). Only for calls from one thread at a
+// time, the sums aren't synchronised.
+template<class Runner>
+struct instrumented {
+#ifdef BFTILE_PERF
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    Counters &counters = threadCounters();
+    counters.start();
+    Runner::gemm::gemm(A, B, C, rowsA, width, colsB);
+    gemmStats() += counters.stop();
+  }
+
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    return Runner::prepareB::preparedSize(rowsB, colsB);
+  }
+
+  static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    Counters &counters = threadCounters();
+    counters.start();
+    Runner::prepareB::prepareBMatrix(in, out, rowsB, colsB);
+    prepareStats() += counters.stop();
+  }
+
+  struct runner {
+    using gemm = bftile::perf::instrumented<Runner>;
+    using prepareB = bftile::perf::instrumented<Runner>;
+  };
+#else
+  typedef Runner runner;
+#endif
+};
+
+} // namespace perf
+} // namespace bftile
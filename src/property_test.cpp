@@ -0,0 +1,654 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include "aligned.h"
+#include "mm128.h"
+#include "mm256.h"
+#include "mm512.h"
+#include "maddubs.h"
+#include "avxvnni.h"
+#include "int16.h"
+#include "int4.h"
+#include "sparse.h"
+#include "parallel.h"
+#include "blocked.h"
+#include "batched.h"
+#include "fixed.h"
+#include "accumulate.h"
+#include "epilogue.h"
+#include "dispatch.h"
+#include "perf.h"
+#include "utils.h"
+
+/************************************************************************************ Property tests ************************************************************************************/
+// Every runner against a plain int64 reference, on random shapes that respect the runner's shape contract and random data.
+// The data comes in several patterns: uniform over the whole range, only the extreme values 0/255 for A and -128/127 for B,
+// mostly zeros, and every product at its largest with the same sign. That last one runs over a width long enough to leave the
+// int32 range, where Saturating drivers have to clip to INT32_MIN/INT32_MAX and NonSaturating ones have to wrap around.
+// Runners that take an epilogue are also checked with a signed A through ShiftedA.
+//
+// The int4 runners of int4.h take B in [-8, 7] only, so theirs is drawn from the int8 patterns divided by 16 and the saturate
+// case needs a width long enough for 255*7 and 255*-8 to leave the int32 range.
+//
+// The block sparse runners of sparse.h get B with about half of its tiles zeroed, in every pattern.
+//
+// The int16 runners of int16.h get the same patterns over the int16 range. For the Saturating ones the data other than the
+// saturate pattern is scaled down to 11 bits, so that no running sum can leave the int32 range and clipping doesn't depend on
+// the order the kernel adds in. The others wrap, which is exact in any order.
+//
+// With --large it instead checks the production sized shapes of largeShapes() on every runner that takes them, against
+// gemmReference, which is fast enough for those. Each of them gets the same data, so the reference runs once per shape.
+// gemmReference is blocked and multithreaded itself, so on the shapes small enough for it the int64 triple loop of runCase
+// checks gemmReference first.
+// That is only the int8 runners with a dense int8 B.
+//
+// Usage: property_test.out [--seed N] [--cases N] [--runner SUBSTRING] [--large]. A failure prints the seed to rerun it with.
+// Without --seed the seed is random, for interactive runs. The CTest entries pass a fixed one so CI is reproducible.
+// Exits with 77, which CTest counts as skipped, on a CPU without AVX512VNNI.
+
+namespace {
+
+typedef std::mt19937_64 Rng;
+
+// A runner as the tests see it
+struct Runner {
+  std::string name;
+  // Shapes have to be multiples of these
+  size_t rowsMultiple;
+  size_t widthMultiple;
+  size_t colsMultiple;
+  bool saturating; // Accumulate policy, which decides what happens past the int32 range
+  size_t (*preparedSize)(size_t rowsB, size_t colsB);
+  void (*prepareBMatrix)(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB);
+  void (*gemm)(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB);
+  // Signed A through a ShiftedA epilogue, nullptr for runners without epilogues
+  void (*prepareSigned)(const int8_t * in, int8_t * out, int32_t * correction, size_t rowsB, size_t colsB);
+  void (*gemmSigned)(const int8_t * A, const int8_t * B, const int32_t * correction, int32_t * C, size_t rowsA, size_t width, size_t colsB);
+  bool (*supported)(); // Whether the CPU has the instructions the runner needs
+  bool int4; // B only holds 4 bits, see int4.h
+  bool blockSparse; // Zero whole tiles of B, see sparse.h
+};
+
+// For runners of RegisterBits wide registers that need whole tiles
+template<size_t RegisterBits, class R>
+Runner tiled(const std::string &name, bool saturating = true) {
+  return {name, RegisterBits/32, RegisterBits/8, RegisterBits/32, saturating, R::prepareB::preparedSize, R::prepareB::prepareBMatrix,
+          R::gemm::gemm, nullptr, nullptr, bftile::cpu::avx512vnni, false, false};
+}
+
+template<class R>
+struct signedA {
+  static void prepare(const int8_t * in, int8_t * out, int32_t * correction, size_t rowsB, size_t colsB) {
+    R::prepareB::prepareBMatrix(in, out, correction, rowsB, colsB);
+  }
+  static void gemm(const int8_t * A, const int8_t * B, const int32_t * correction, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    R::gemm::gemm(reinterpret_cast<const uint8_t *>(A), B, rowsA, width, colsB, bftile::shiftedA(correction, bftile::AccumulateC(C, colsB)));
+  }
+};
+
+// For runners that take any shape
+template<class R>
+Runner anyShape(const std::string &name, bool saturating = true) {
+  return {name, 1, 1, 1, saturating, R::prepareB::preparedSize, R::prepareB::prepareBMatrix, R::gemm::gemm, nullptr, nullptr,
+          bftile::cpu::avx512vnni, false, false};
+}
+
+// The same for the families that run on less than AVX512VNNI: the maddubs fallbacks (see maddubs.h), which wrap like
+// NonSaturating, and AVX-VNNI (see avxvnni.h)
+template<class R>
+Runner fallback(const std::string &name, bool (*supported)(), bool saturating = false) {
+  Runner runner = anyShape<R>(name, saturating);
+  runner.supported = supported;
+  return runner;
+}
+
+// A fallback gemm on B prepared by the AVX512VNNI anyshape of the same width, which has to be the same layout
+template<class Fallback, class Prepare>
+struct crossPrepared {
+  using gemm = typename Fallback::gemm;
+  using prepareB = typename Prepare::prepareB;
+};
+
+// The same, with epilogues
+template<class R>
+Runner anyShapeEpilogue(const std::string &name, bool saturating = true) {
+  Runner runner = anyShape<R>(name, saturating);
+  runner.prepareSigned = signedA<R>::prepare;
+  runner.gemmSigned = signedA<R>::gemm;
+  return runner;
+}
+
+// The same runner on a B of 4 bit weights
+Runner int4Weights(Runner runner) {
+  runner.int4 = true;
+  return runner;
+}
+
+// The same runner on a B with tiles of zeros
+Runner blockSparse(Runner runner) {
+  runner.blockSparse = true;
+  return runner;
+}
+
+// The rows of a shape cut into a batch of problems of random heights, all sharing the B
+template<class R>
+struct batchedRows {
+  static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    std::vector<bftile::GemmProblem> problems;
+    for (size_t i = 0, rows = 1; i < rowsA; i += rows, rows = rows % 7 + 3) {
+      rows = std::min(rows, rowsA - i);
+      problems.push_back({A + i*width, B, C + i*colsB, rows, width, colsB});
+    }
+    std::reverse(problems.begin(), problems.end()); // The batch sorts them back into groups
+    bftile::batched<R>::gemm(problems.data(), problems.size());
+  }
+};
+
+typedef bftile::fixedShapes<bftile::mm512::depthfirstaddrlooptileloopwritedepend::runner, bftile::Shape<64, 16>, bftile::Shape<128, 32>,
+                            bftile::Shape<64, 80>> mm512Fixed;
+typedef bftile::fixedShapes<bftile::mm256::depthfirstaddrlooptileloopwritedepend::runner, bftile::Shape<32, 8>, bftile::Shape<64, 16>> mm256Fixed;
+typedef bftile::fixedShapes<bftile::depthfirstaddrlooptileloopwritedepend::runner, bftile::Shape<16, 4>, bftile::Shape<32, 8>> mm128Fixed;
+
+// Ice Lake and friends have AVX512VNNI without AVX-VNNI, the client cores the other way around
+bool bothVnni() {
+  return bftile::cpu::avx512vnni() && bftile::cpu::avxvnni();
+}
+
+std::vector<Runner> runners() {
+  using namespace bftile;
+  Runner mm512Batched = anyShape<mm512::anyshape::runner>("mm512/batched-anyshape");
+  mm512Batched.gemm = batchedRows<mm512::anyshape::runner>::gemm;
+  Runner mm128Batched = anyShape<anyshape::runner>("mm128/batched-anyshape");
+  mm128Batched.gemm = batchedRows<anyshape::runner>::gemm;
+  // Every backend wraps around at the int32 range, see dispatch.h
+  Runner dispatchedRunner = {std::string("dispatched/") + backend().name, backend().rowsMultiple, backend().widthMultiple,
+                             backend().colsMultiple, false, backend().preparedSize, backend().prepareBMatrix,
+                             backend().gemm, nullptr, nullptr, backend().supported, false, false};
+  return {
+    tiled<128, breadthfirst::runner>("mm128/breadthfirst"),
+    tiled<128, depthfirst::runner>("mm128/depthfirst"),
+    tiled<128, depthfirstaddr::runner>("mm128/depthfirstaddr"),
+    tiled<128, depthfirstaddrloop::runner>("mm128/depthfirstaddrloop"),
+    tiled<128, depthfirstaddrlooptileloop::runner>("mm128/depthfirstaddrlooptileloop"),
+    tiled<128, depthfirstaddrlooptileloopwritedepend::runner>("mm128/depthfirstaddrlooptileloopwritedepend"),
+    tiled<128, depthfirstaddrlooptileloopwritedependWith<NonSaturating>::runner>("mm128/depthfirstaddrlooptileloopwritedepend-nonsaturating", false),
+    tiled<128, parallel<depthfirstaddrlooptileloopwritedepend::runner>::runner>("mm128/parallel-depthfirstaddrlooptileloopwritedepend"),
+    tiled<128, mm128Fixed::runner>("mm128/fixed"),
+    tiled<128, registeraccumulated<>::runner>("mm128/registeraccumulated"),
+    tiled<128, registeraccumulated<2, NonSaturating>::runner>("mm128/registeraccumulated2-nonsaturating", false),
+    anyShapeEpilogue<anyshape::runner>("mm128/anyshape"),
+    anyShape<anyshapeWith<NonSaturating>::runner>("mm128/anyshape-nonsaturating", false),
+    anyShape<blocked<anyshape::runner, 64, 8, 8>::runner>("mm128/blocked-anyshape"),
+    anyShapeEpilogue<packedA::runner>("mm128/packedA"),
+    anyShape<packedAWith<NonSaturating>::runner>("mm128/packedA-nonsaturating", false),
+    mm128Batched,
+    tiled<256, mm256::depthfirstaddrlooptileloopwritedepend::runner>("mm256/depthfirstaddrlooptileloopwritedepend"),
+    tiled<256, mm256::depthfirstaddrlooptileloopwritedependWith<NonSaturating>::runner>("mm256/depthfirstaddrlooptileloopwritedepend-nonsaturating", false),
+    tiled<256, parallel<mm256::depthfirstaddrlooptileloopwritedepend::runner>::runner>("mm256/parallel-depthfirstaddrlooptileloopwritedepend"),
+    tiled<256, mm256Fixed::runner>("mm256/fixed"),
+    tiled<256, mm256::registeraccumulated<>::runner>("mm256/registeraccumulated"),
+    tiled<256, mm256::registeraccumulated<4>::runner>("mm256/registeraccumulated4"),
+    anyShapeEpilogue<mm256::anyshape::runner>("mm256/anyshape"),
+    anyShape<mm256::anyshapeWith<NonSaturating>::runner>("mm256/anyshape-nonsaturating", false),
+    anyShapeEpilogue<mm256::packedA::runner>("mm256/packedA"),
+    anyShape<mm256::packedAWith<NonSaturating>::runner>("mm256/packedA-nonsaturating", false),
+    tiled<512, mm512::depthfirstaddrlooptileloopwritedepend::runner>("mm512/depthfirstaddrlooptileloopwritedepend"),
+    tiled<512, mm512::depthfirstaddrlooptileloopwritedependWith<NonSaturating>::runner>("mm512/depthfirstaddrlooptileloopwritedepend-nonsaturating", false),
+    tiled<512, parallel<mm512::depthfirstaddrlooptileloopwritedepend::runner>::runner>("mm512/parallel-depthfirstaddrlooptileloopwritedepend"),
+    tiled<512, blocked<mm512::depthfirstaddrlooptileloopwritedepend::runner, 128, 32, 32>::runner>("mm512/blocked-depthfirstaddrlooptileloopwritedepend"),
+    tiled<512, mm512::registerblocked<1>::runner>("mm512/registerblocked1"),
+    tiled<512, mm512::registerblocked<2>::runner>("mm512/registerblocked2"),
+    tiled<512, mm512::registerblocked<3>::runner>("mm512/registerblocked3"),
+    tiled<512, mm512::registerblocked<4>::runner>("mm512/registerblocked4"),
+    tiled<512, mm512::registerblocked<2, NonSaturating>::runner>("mm512/registerblocked2-nonsaturating", false),
+    tiled<512, mm512Fixed::runner>("mm512/fixed"),
+    tiled<512, mm512::registeraccumulated<>::runner>("mm512/registeraccumulated"),
+    tiled<512, mm512::registeraccumulated<16>::runner>("mm512/registeraccumulated16"),
+    tiled<512, mm512::registeraccumulated<4, NonSaturating>::runner>("mm512/registeraccumulated4-nonsaturating", false),
+    tiled<512, parallel<mm512::registeraccumulated<>::runner>::runner>("mm512/parallel-registeraccumulated"),
+    tiled<512, mm512::prefetched<0>::runner>("mm512/prefetched0"),
+    tiled<512, mm512::prefetched<2>::runner>("mm512/prefetched2"),
+    tiled<512, mm512::prefetched<4, true>::runner>("mm512/prefetched4-streamc"),
+    tiled<512, parallel<mm512::prefetched<2, true>::runner>::runner>("mm512/parallel-prefetched2-streamc"),
+    anyShapeEpilogue<mm512::anyshape::runner>("mm512/anyshape"),
+    anyShape<mm512::anyshapeWith<NonSaturating>::runner>("mm512/anyshape-nonsaturating", false),
+    anyShapeEpilogue<parallel<mm512::anyshape::runner>::runner>("mm512/parallel-anyshape"),
+    anyShape<blocked<mm512::anyshape::runner, 64, 16, 32>::runner>("mm512/blocked-anyshape"),
+    anyShape<blocked<mm512::anyshape::runner>::runner>("mm512/blocked-anyshape-default"),
+    anyShapeEpilogue<mm512::packedA::runner>("mm512/packedA"),
+    anyShape<mm512::packedAWith<NonSaturating>::runner>("mm512/packedA-nonsaturating", false),
+    anyShapeEpilogue<parallel<mm512::packedA::runner>::runner>("mm512/parallel-packedA"),
+    anyShapeEpilogue<mm512::gemv::runner>("mm512/gemv"),
+    anyShape<mm512::gemvWith<NonSaturating>::runner>("mm512/gemv-nonsaturating", false),
+    anyShape<perf::instrumented<mm512::anyshape::runner>::runner>("mm512/instrumented-anyshape"),
+    mm512Batched,
+    fallback<avx2::anyshape::runner>("avx2/anyshape", cpu::avx2),
+    fallback<parallel<avx2::anyshape::runner>::runner>("avx2/parallel-anyshape", cpu::avx2),
+    fallback<blocked<avx2::anyshape::runner, 64, 16, 64>::runner>("avx2/blocked-anyshape", cpu::avx2),
+    fallback<crossPrepared<avx2::anyshape::runner, mm256::anyshape::runner>>("avx2/anyshape-mm256-prepared", cpu::avx512vnni),
+    fallback<avxvnni::anyshape::runner>("avxvnni/anyshape", cpu::avxvnni, true),
+    fallback<avxvnni::anyshapeWith<avxvnni::NonSaturating>::runner>("avxvnni/anyshape-nonsaturating", cpu::avxvnni),
+    fallback<parallel<avxvnni::anyshape::runner>::runner>("avxvnni/parallel-anyshape", cpu::avxvnni, true),
+    fallback<blocked<avxvnni::anyshape::runner, 64, 16, 64>::runner>("avxvnni/blocked-anyshape", cpu::avxvnni, true),
+    fallback<crossPrepared<avxvnni::anyshape::runner, mm256::anyshape::runner>>("avxvnni/anyshape-mm256-prepared", bothVnni, true),
+    fallback<avx512bw::anyshape::runner>("avx512bw/anyshape", cpu::avx512bw),
+    fallback<parallel<avx512bw::anyshape::runner>::runner>("avx512bw/parallel-anyshape", cpu::avx512bw),
+    fallback<blocked<avx512bw::anyshape::runner, 64, 16, 64>::runner>("avx512bw/blocked-anyshape", cpu::avx512bw),
+    fallback<crossPrepared<avx512bw::anyshape::runner, mm512::anyshape::runner>>("avx512bw/anyshape-mm512-prepared", cpu::avx512vnni),
+    int4Weights(anyShapeEpilogue<int4::mm512::anyshape::runner>("int4/mm512/anyshape")),
+    int4Weights(anyShape<int4::mm512::anyshapeWith<NonSaturating>::runner>("int4/mm512/anyshape-nonsaturating", false)),
+    int4Weights(anyShapeEpilogue<parallel<int4::mm512::anyshape::runner>::runner>("int4/mm512/parallel-anyshape")),
+    int4Weights(anyShape<blocked<int4::mm512::anyshape::runner, 64, 16, 64>::runner>("int4/mm512/blocked-anyshape")),
+    int4Weights(anyShapeEpilogue<int4::mm512::gemv::runner>("int4/mm512/gemv")),
+    int4Weights(anyShape<int4::mm512::gemvWith<NonSaturating>::runner>("int4/mm512/gemv-nonsaturating", false)),
+    blockSparse(anyShapeEpilogue<sparse::mm512::anyshape::runner>("sparse/mm512/anyshape")),
+    blockSparse(anyShape<sparse::mm512::anyshapeWith<NonSaturating>::runner>("sparse/mm512/anyshape-nonsaturating", false)),
+    blockSparse(anyShapeEpilogue<sparse::mm512::parallelGemm<sparse::mm512::anyshape::runner>>("sparse/mm512/parallel-anyshape")),
+    blockSparse(anyShape<blocked<sparse::mm512::anyshape::runner, 64, 16, 64>::runner>("sparse/mm512/blocked-anyshape")),
+    dispatchedRunner,
+  };
+}
+
+// How the data of a case is drawn
+enum Pattern {
+  uniform, // Anything in range
+  extremes, // Only 0 and 255 for A, -128 and 127 for B (and -128 and 127 for a signed A)
+  sparse, // Mostly zeros with the odd extreme value
+  saturate, // A all 255 and every column of B all 127 or all -128, over a width that leaves the int32 range
+  patternCount
+};
+
+const char * patternName(Pattern pattern) {
+  static const char * names[patternCount] = {"uniform", "extremes", "sparse", "saturate"};
+  return names[pattern];
+}
+
+// Shortest width, in multiples of 64, where 255*127*width passes INT32_MAX
+static const constexpr size_t saturatingWidth = 1041*64;
+// and where 255*7*width does, for the 4 bit B
+static const constexpr size_t int4SaturatingWidth = 18799*64;
+
+template<class T>
+T draw(Rng &rng, Pattern pattern, size_t column) {
+  const int lo = std::numeric_limits<T>::min();
+  const int hi = std::numeric_limits<T>::max();
+  switch (pattern) {
+    case extremes:
+      return static_cast<T>(rng() % 2 ? lo : hi);
+    case sparse:
+      return static_cast<T>(rng() % 8 ? 0 : rng() % 2 ? lo : hi);
+    case saturate:
+      return static_cast<T>(lo == 0 ? hi : column % 2 ? lo : hi);
+    default:
+      return static_cast<T>(lo + static_cast<int>(rng() % (hi - lo + 1)));
+  }
+}
+
+// The exact product in int64, and what the accumulate policy makes of it in int32. With the saturate pattern every running sum
+// moves the same way, so clipping once at the end is the same as dpbusds clipping at every step.
+template<class AType, class BType>
+void reference(const AType * A, const BType * B, int32_t * C, size_t rowsA, size_t width, size_t colsB, bool saturating) {
+  for (size_t i = 0; i < rowsA; i++) {
+    for (size_t j = 0; j < colsB; j++) {
+      int64_t sum = 0;
+      for (size_t w = 0; w < width; w++) {
+        sum += static_cast<int64_t>(A[i*width + w])*B[j*width + w];
+      }
+      if (saturating) {
+        sum = std::min<int64_t>(std::max<int64_t>(sum, std::numeric_limits<int32_t>::min()), std::numeric_limits<int32_t>::max());
+      }
+      C[i*colsB + j] = static_cast<int32_t>(static_cast<uint32_t>(sum)); // Wraps like dpbusd does
+    }
+  }
+}
+
+// Up to limit multiples of multiple, more often small than big
+size_t drawSize(Rng &rng, size_t multiple, size_t limit) {
+  const size_t count = rng() % 4 ? 1 + rng() % std::max<size_t>(limit/4, 1) : 1 + rng() % limit;
+  return multiple*count;
+}
+
+struct Case {
+  bftile::matrix shape;
+  Pattern pattern;
+  bool signedA;
+};
+
+Case drawCase(Rng &rng, const Runner &runner, size_t index) {
+  Case test;
+  // The saturate case is the slow one, so only the fourth case of a runner gets it
+  test.pattern = index == saturate ? saturate : static_cast<Pattern>(index % saturate);
+  test.signedA = runner.gemmSigned && test.pattern != saturate && rng() % 3 == 0;
+  if (test.pattern == saturate) {
+    // As narrow as the runner allows, the width does the work
+    test.shape = {runner.rowsMultiple, runner.int4 ? int4SaturatingWidth : saturatingWidth, runner.colsMultiple};
+    test.shape.width += runner.widthMultiple == 1 ? rng() % 64 : 0;
+  } else if (index % 16 == 15) {
+    // Once in a while something big enough to be split up by the parallel, blocked and batched drivers
+    test.shape = {drawSize(rng, runner.rowsMultiple, 300/runner.rowsMultiple), drawSize(rng, runner.widthMultiple, 1200/runner.widthMultiple),
+                  drawSize(rng, runner.colsMultiple, 300/runner.colsMultiple)};
+  } else {
+    test.shape = {drawSize(rng, runner.rowsMultiple, std::max<size_t>(40/runner.rowsMultiple, 4)),
+                  drawSize(rng, runner.widthMultiple, std::max<size_t>(400/runner.widthMultiple, 4)),
+                  drawSize(rng, runner.colsMultiple, std::max<size_t>(70/runner.colsMultiple, 4))};
+  }
+  return test;
+}
+
+// Runs one case, returns true if it failed
+bool runCase(Rng &rng, const Runner &runner, const Case &test) {
+  using namespace bftile;
+  const size_t aRows = test.shape.aRows;
+  const size_t width = test.shape.width;
+  const size_t bCols = test.shape.bCols;
+
+  AlignedVector<uint8_t> A(aRows*width);
+  AlignedVector<int8_t> B(width*bCols);
+  AlignedVector<int8_t> BReord(runner.preparedSize(width, bCols));
+  AlignedVector<int32_t> correction(bCols);
+  AlignedVector<int32_t> Cref(aRows*bCols);
+  AlignedVector<int32_t> Cfast(aRows*bCols);
+  const int bScale = runner.int4 ? 16 : 1; // -128/16 and 127/16 are the extremes of int4
+  int8_t * signedAData = reinterpret_cast<int8_t *>(A.begin());
+
+  for (size_t i = 0; i < aRows*width; i++) {
+    if (test.signedA) {
+      signedAData[i] = draw<int8_t>(rng, test.pattern, 0);
+    } else {
+      A[i] = draw<uint8_t>(rng, test.pattern, 0);
+    }
+  }
+  for (size_t j = 0; j < bCols; j++) {
+    for (size_t w = 0; w < width; w++) {
+      B[j*width + w] = static_cast<int8_t>(draw<int8_t>(rng, test.pattern, j)/bScale);
+    }
+  }
+  // Tiles of 64 rows by 16 columns, the tiles of the 512 bit prepareB
+  for (size_t j = 0; runner.blockSparse && j < bCols; j += 16) {
+    for (size_t w = 0; w < width; w += 64) {
+      if (rng() % 2) {
+        for (size_t col = j; col < std::min(j + 16, bCols); col++) {
+          std::fill(B.begin() + col*width + w, B.begin() + col*width + std::min(w + 64, width), 0);
+        }
+      }
+    }
+  }
+  // Garbage in the padding of the prepared B must not leak into C
+  std::fill(BReord.begin(), BReord.end(), static_cast<int8_t>(rng()));
+  std::fill(Cfast.begin(), Cfast.end(), 0);
+
+  if (test.signedA) {
+    reference(signedAData, B.begin(), Cref.begin(), aRows, width, bCols, runner.saturating);
+    runner.prepareSigned(B.begin(), BReord.begin(), correction.begin(), width, bCols);
+    runner.gemmSigned(signedAData, BReord.begin(), correction.begin(), Cfast.begin(), aRows, width, bCols);
+  } else {
+    reference(A.begin(), B.begin(), Cref.begin(), aRows, width, bCols, runner.saturating);
+    runner.prepareBMatrix(B.begin(), BReord.begin(), width, bCols);
+    runner.gemm(A.begin(), BReord.begin(), Cfast.begin(), aRows, width, bCols);
+  }
+
+  for (size_t i = 0; i < aRows*bCols; i++) {
+    if (Cfast[i] != Cref[i]) {
+      std::cerr << runner.name << " differs from the reference on " << aRows << "x" << width << "x" << bCols << " with "
+                << patternName(test.pattern) << (test.signedA ? " signed" : "") << " data: C[" << i/bCols << "][" << i % bCols
+                << "] is " << Cfast[i] << ", expected " << Cref[i] << std::endl;
+      return true;
+    }
+  }
+  return false;
+}
+
+/************************************************************************************ int16 ************************************************************************************/
+
+struct Int16Runner {
+  std::string name;
+  size_t rowsMultiple;
+  size_t widthMultiple;
+  size_t colsMultiple;
+  bool saturating;
+  bool (*supported)();
+  size_t (*preparedSize)(size_t rowsB, size_t colsB);
+  void (*prepareBMatrix)(const int16_t * in, int16_t * out, size_t rowsB, size_t colsB);
+  void (*gemm)(const int16_t * A, const int16_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB);
+};
+
+// A register of RegisterBits holds RegisterBits/16 int16 of the width
+template<size_t RegisterBits, class R>
+Int16Runner int16Tiled(const std::string &name, bool saturating = true) {
+  return {name, RegisterBits/32, RegisterBits/16, RegisterBits/32, saturating, bftile::cpu::avx512vnni, R::prepareB::preparedSize,
+          R::prepareB::prepareBMatrix, R::gemm::gemm};
+}
+
+template<class R>
+Int16Runner int16AnyShape(const std::string &name, bool saturating = true, bool (*supported)() = bftile::cpu::avx512vnni) {
+  return {name, 1, 1, 1, saturating, supported, R::prepareB::preparedSize, R::prepareB::prepareBMatrix, R::gemm::gemm};
+}
+
+std::vector<Int16Runner> int16Runners() {
+  using namespace bftile;
+  return {
+    int16AnyShape<int16::anyshape::runner>("int16/mm128/anyshape"),
+    int16AnyShape<int16::anyshapeWith<int16::NonSaturating>::runner>("int16/mm128/anyshape-nonsaturating", false),
+    int16Tiled<256, int16::mm256::depthfirstaddrlooptileloopwritedepend::runner>("int16/mm256/depthfirstaddrlooptileloopwritedepend"),
+    int16AnyShape<int16::mm256::anyshape::runner>("int16/mm256/anyshape"),
+    int16Tiled<512, int16::mm512::depthfirstaddrlooptileloopwritedepend::runner>("int16/mm512/depthfirstaddrlooptileloopwritedepend"),
+    int16Tiled<512, int16::mm512::depthfirstaddrlooptileloopwritedependWith<int16::NonSaturating>::runner>(
+        "int16/mm512/depthfirstaddrlooptileloopwritedepend-nonsaturating", false),
+    int16Tiled<512, int16::mm512::registeraccumulated::runner>("int16/mm512/registeraccumulated"),
+    int16AnyShape<int16::mm512::anyshape::runner>("int16/mm512/anyshape"),
+    int16AnyShape<int16::mm512::anyshapeWith<int16::NonSaturating>::runner>("int16/mm512/anyshape-nonsaturating", false),
+    int16AnyShape<int16::widened<parallel<mm512::anyshapeWith<int16::Saturating>::runner>::runner>::runner>("int16/mm512/parallel-anyshape"),
+    int16AnyShape<int16::mm512::gemv::runner>("int16/mm512/gemv"),
+    int16AnyShape<int16::avxvnni::anyshape::runner>("int16/avxvnni/anyshape", true, cpu::avxvnni),
+    int16AnyShape<int16::avxvnni::anyshapeWith<int16::avxvnni::NonSaturating>::runner>("int16/avxvnni/anyshape-nonsaturating", false,
+                                                                                       cpu::avxvnni),
+    int16AnyShape<int16::avx512bw::anyshape::runner>("int16/avx512bw/anyshape", false, cpu::avx512bw),
+    int16AnyShape<int16::avx2::anyshape::runner>("int16/avx2/anyshape", false, cpu::avx2),
+  };
+}
+
+// Same pattern scheme as drawCase, where the saturate pattern needs only a few products of 32767*32767 to leave int32
+Case drawInt16Case(Rng &rng, const Int16Runner &runner, size_t index) {
+  Case test;
+  test.pattern = index == saturate ? saturate : static_cast<Pattern>(index % saturate);
+  test.signedA = false;
+  if (test.pattern == saturate) {
+    test.shape = {runner.rowsMultiple, drawSize(rng, runner.widthMultiple, std::max<size_t>(64/runner.widthMultiple, 4)), runner.colsMultiple};
+    test.shape.width = std::max<size_t>(test.shape.width, 4*runner.widthMultiple);
+  } else if (index % 16 == 15) {
+    test.shape = {drawSize(rng, runner.rowsMultiple, 300/runner.rowsMultiple), drawSize(rng, runner.widthMultiple, 1200/runner.widthMultiple),
+                  drawSize(rng, runner.colsMultiple, 300/runner.colsMultiple)};
+  } else {
+    test.shape = {drawSize(rng, runner.rowsMultiple, std::max<size_t>(40/runner.rowsMultiple, 4)),
+                  drawSize(rng, runner.widthMultiple, std::max<size_t>(400/runner.widthMultiple, 4)),
+                  drawSize(rng, runner.colsMultiple, std::max<size_t>(70/runner.colsMultiple, 4))};
+  }
+  return test;
+}
+
+// Runs one int16 case, returns true if it failed
+bool runInt16Case(Rng &rng, const Int16Runner &runner, const Case &test) {
+  using namespace bftile;
+  const size_t aRows = test.shape.aRows;
+  const size_t width = test.shape.width;
+  const size_t bCols = test.shape.bCols;
+  // 11 bits: 1200*1024*1024 stays inside int32
+  const int scale = runner.saturating && test.pattern != saturate ? 32 : 1;
+
+  AlignedVector<int16_t> A(aRows*width);
+  AlignedVector<int16_t> B(width*bCols);
+  AlignedVector<int16_t> BReord(runner.preparedSize(width, bCols));
+  AlignedVector<int32_t> Cref(aRows*bCols);
+  AlignedVector<int32_t> Cfast(aRows*bCols);
+
+  for (size_t i = 0; i < aRows*width; i++) {
+    A[i] = static_cast<int16_t>(draw<int16_t>(rng, test.pattern, 0)/scale);
+  }
+  for (size_t j = 0; j < bCols; j++) {
+    for (size_t w = 0; w < width; w++) {
+      B[j*width + w] = static_cast<int16_t>(draw<int16_t>(rng, test.pattern, j)/scale);
+    }
+  }
+  std::fill(BReord.begin(), BReord.end(), static_cast<int16_t>(rng()));
+  std::fill(Cfast.begin(), Cfast.end(), 0);
+
+  reference(A.begin(), B.begin(), Cref.begin(), aRows, width, bCols, runner.saturating);
+  runner.prepareBMatrix(B.begin(), BReord.begin(), width, bCols);
+  runner.gemm(A.begin(), BReord.begin(), Cfast.begin(), aRows, width, bCols);
+
+  for (size_t i = 0; i < aRows*bCols; i++) {
+    if (Cfast[i] != Cref[i]) {
+      std::cerr << runner.name << " differs from the reference on " << aRows << "x" << width << "x" << bCols << " with "
+                << patternName(test.pattern) << " data: C[" << i/bCols << "][" << i % bCols << "] is " << Cfast[i]
+                << ", expected " << Cref[i] << std::endl;
+      return true;
+    }
+  }
+  return false;
+}
+
+// The runners named by the filters (all of them without filters) that this CPU can run
+template<class R>
+std::vector<R> selectRunners(const std::vector<R> &runners, const std::vector<std::string> &filters, size_t &unsupported) {
+  std::vector<R> selected;
+  for (const R &runner : runners) {
+    bool wanted = filters.empty();
+    for (const std::string &filter : filters) {
+      wanted = wanted || runner.name.find(filter) != std::string::npos;
+    }
+    if (wanted && !runner.supported()) {
+      unsupported++;
+    } else if (wanted) {
+      selected.push_back(runner);
+    }
+  }
+  return selected;
+}
+
+// Shapes the way the models use them, mostly too big for the int64 reference of runCase
+std::vector<bftile::matrix> largeShapes() {
+  return {{1024, 1024, 1024}, {4096, 4096, 128}, {640, 320, 320}, {16, 2048, 256}, {1, 4096, 4096}, {1000, 1000, 1000}};
+}
+
+// Every runner that takes shape on the same uniform data, against gemmReference. Returns the number of runners that failed.
+size_t runLarge(Rng &rng, const std::vector<Runner> &runners, const bftile::matrix &shape, size_t &run) {
+  using namespace bftile;
+  const size_t aRows = shape.aRows;
+  const size_t width = shape.width;
+  const size_t bCols = shape.bCols;
+  AlignedVector<uint8_t> A(aRows*width);
+  AlignedVector<int8_t> B(width*bCols);
+  AlignedVector<int32_t> Cref(aRows*bCols);
+  AlignedVector<int32_t> Cfast(aRows*bCols);
+  for (auto&& item : A) {
+    item = draw<uint8_t>(rng, uniform, 0);
+  }
+  for (auto&& item : B) {
+    item = draw<int8_t>(rng, uniform, 0);
+  }
+  std::fill(Cref.begin(), Cref.end(), 0);
+  gemmReference(A.begin(), B.begin(), Cref.begin(), aRows, width, bCols);
+
+  size_t failed = 0;
+  // A few seconds at most for the triple loop
+  static const constexpr size_t naiveLimit = size_t(1) << 28;
+  if (aRows*width*bCols <= naiveLimit) {
+    AlignedVector<int32_t> Cnaive(aRows*bCols);
+    reference(A.begin(), B.begin(), Cnaive.begin(), aRows, width, bCols, false);
+    run++;
+    for (size_t i = 0; i < aRows*bCols; i++) {
+      if (Cref[i] != Cnaive[i]) {
+        std::cerr << "gemmReference differs from the triple loop on " << aRows << "x" << width << "x" << bCols << ": C[" << i/bCols
+                  << "][" << i % bCols << "] is " << Cref[i] << ", expected " << Cnaive[i] << std::endl;
+        failed++;
+        break;
+      }
+    }
+  }
+  for (const Runner &runner : runners) {
+    if (runner.int4 || runner.blockSparse || aRows % runner.rowsMultiple || width % runner.widthMultiple || bCols % runner.colsMultiple) {
+      continue;
+    }
+    AlignedVector<int8_t> BReord(runner.preparedSize(width, bCols));
+    std::fill(Cfast.begin(), Cfast.end(), 0);
+    runner.prepareBMatrix(B.begin(), BReord.begin(), width, bCols);
+    runner.gemm(A.begin(), BReord.begin(), Cfast.begin(), aRows, width, bCols);
+    run++;
+    for (size_t i = 0; i < aRows*bCols; i++) {
+      if (Cfast[i] != Cref[i]) {
+        std::cerr << runner.name << " differs from the reference on " << aRows << "x" << width << "x" << bCols << ": C[" << i/bCols
+                  << "][" << i % bCols << "] is " << Cfast[i] << ", expected " << Cref[i] << std::endl;
+        failed++;
+        break;
+      }
+    }
+  }
+  return failed;
+}
+
+} // namespace
+
+int main(int argc, char ** argv) {
+  uint64_t seed = std::random_device()();
+  size_t cases = 48;
+  std::vector<std::string> filters;
+  bool large = false;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg == "--seed" && i + 1 < argc) {
+      seed = std::strtoull(argv[++i], nullptr, 10);
+    } else if (arg == "--cases" && i + 1 < argc) {
+      cases = std::strtoul(argv[++i], nullptr, 10);
+    } else if (arg == "--runner" && i + 1 < argc) {
+      filters.push_back(argv[++i]);
+    } else if (arg == "--large") {
+      large = true;
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--seed N] [--cases N] [--runner SUBSTRING]... [--large]" << std::endl;
+      return 1;
+    }
+  }
+  size_t unsupported = 0;
+  const std::vector<Runner> selected = selectRunners(runners(), filters, unsupported);
+  const std::vector<Int16Runner> selectedInt16 = large ? std::vector<Int16Runner>() : selectRunners(int16Runners(), filters, unsupported);
+  if (unsupported) {
+    std::cerr << "Skipping " << unsupported << " runners this CPU doesn't support." << std::endl;
+  }
+  if (selected.empty() && selectedInt16.empty()) {
+    return 77;
+  }
+
+  size_t failed = 0;
+  size_t run = 0;
+  if (large) {
+    Rng rng(seed);
+    for (const bftile::matrix &shape : largeShapes()) {
+      failed += runLarge(rng, selected, shape, run);
+    }
+    std::cerr << run - failed << "/" << run << " large runs passed with --seed " << seed << std::endl;
+    return failed ? 1 : 0;
+  }
+  for (const Runner &runner : selected) {
+    // Every runner gets its own stream, so that a failure can be rerun on its own with --runner and the same seed
+    Rng rng(seed ^ std::hash<std::string>()(runner.name));
+    for (size_t index = 0; index < cases; index++) {
+      failed += runCase(rng, runner, drawCase(rng, runner, index));
+      run++;
+    }
+  }
+  for (const Int16Runner &runner : selectedInt16) {
+    Rng rng(seed ^ std::hash<std::string>()(runner.name));
+    for (size_t index = 0; index < cases; index++) {
+      failed += runInt16Case(rng, runner, drawInt16Case(rng, runner, index));
+      run++;
+    }
+  }
+  std::cerr << run - failed << "/" << run << " cases passed with --seed " << seed << std::endl;
+  return failed ? 1 : 0;
+}
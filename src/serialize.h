@@ -0,0 +1,197 @@
+#pragma once
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "aligned.h"
+#include "epilogue.h"
+#include "utils.h"
+
+namespace bftile {
+/************************************************************************************ serialized prepared B ************************************************************************************/
+// An already reordered B on disk, so that a process can map it and start multiplying instead of preparing every weight matrix
+// at startup. Every process that maps the same file shares the same physical pages, and loading only costs the page faults.
+//
+// The file is a 512 byte header, then the colsB int32 column sum corrections for a signed A (see ShiftedA) if there are any,
+// then the prepared B. Both start on a multiple of 512 bytes, so once the file is mapped (at a page boundary) they are aligned
+// for any register. Everything is little endian, like the machines the kernels run on.
+
+static const constexpr size_t preparedAlignment = 512;
+static const constexpr uint32_t preparedVersion = 1;
+static const char preparedMagic[8] = {'B', 'F', 'T', 'I', 'L', 'E', 'B', '\0'};
+
+struct PreparedHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t registerBits; // 128, 256 or 512: the register width the B was prepared for
+  uint32_t layout; // A PreparedLayout
+  uint32_t reserved;
+  uint64_t rowsB; // The shape of B before it was prepared, rowsB == width
+  uint64_t colsB;
+  float scale; // Quantization scale of B, for the caller to use in its epilogue. The file doesn't care.
+  uint32_t hasCorrection;
+  uint64_t correctionOffset; // Byte offsets from the start of the file, correctionOffset is 0 when there is no correction
+  uint64_t dataOffset;
+  uint64_t dataSize; // Bytes of prepared B
+  uint8_t padding[preparedAlignment - 72];
+};
+static_assert(sizeof(PreparedHeader) == preparedAlignment, "The prepared B header has to fill exactly one alignment unit");
+
+inline size_t alignPrepared(size_t offset) {
+  return (offset + preparedAlignment - 1)/preparedAlignment*preparedAlignment;
+}
+
+// Writes an already prepared B. correction is either nullptr or colsB int32s from prepareShiftCorrection.
+inline void writePrepared(const std::string &path, const int8_t * prepared, size_t preparedSize, uint32_t registerBits,
+                          PreparedLayout layout, size_t rowsB, size_t colsB, float scale, const int32_t * correction = nullptr) {
+  PreparedHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, preparedMagic, sizeof(preparedMagic));
+  header.version = preparedVersion;
+  header.registerBits = registerBits;
+  header.layout = static_cast<uint32_t>(layout);
+  header.rowsB = rowsB;
+  header.colsB = colsB;
+  header.scale = scale;
+  header.hasCorrection = correction != nullptr;
+  header.correctionOffset = correction ? sizeof(header) : 0;
+  header.dataOffset = correction ? alignPrepared(sizeof(header) + colsB*sizeof(int32_t)) : sizeof(header);
+  header.dataSize = preparedSize;
+
+  FILE * file = std::fopen(path.c_str(), "wb");
+  if (!file) {
+    throw std::runtime_error("Can't open " + path + " for writing: " + std::strerror(errno));
+  }
+  static const char zeros[preparedAlignment] = {0};
+  bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+  if (written && correction) {
+    const size_t correctionBytes = colsB*sizeof(int32_t);
+    written = std::fwrite(correction, 1, correctionBytes, file) == correctionBytes;
+    const size_t pad = header.dataOffset - sizeof(header) - correctionBytes;
+    written = written && std::fwrite(zeros, 1, pad, file) == pad;
+  }
+  written = written && std::fwrite(prepared, 1, preparedSize, file) == preparedSize;
+  if (std::fclose(file) != 0 || !written) {
+    throw std::runtime_error("Failed writing the prepared B to " + path);
+  }
+}
+
+// Prepares a column major B with Prepare (depthfirst, anyshape...) and writes it, along with the correction for a signed A
+// if withCorrection is set.
+template<class Prepare>
+void writePrepared(const std::string &path, const int8_t * B, size_t rowsB, size_t colsB, float scale = 1.0f, bool withCorrection = false) {
+  AlignedVector<int8_t> prepared(Prepare::preparedSize(rowsB, colsB));
+  Prepare::prepareBMatrix(B, prepared.begin(), rowsB, colsB);
+  AlignedVector<int32_t> correction(withCorrection ? colsB : 0);
+  if (withCorrection) {
+    prepareShiftCorrection(B, correction.begin(), rowsB, colsB);
+  }
+  writePrepared(path, prepared.begin(), prepared.size(), Prepare::registerBits, Prepare::layout, rowsB, colsB, scale,
+                withCorrection ? correction.begin() : nullptr);
+}
+
+// A prepared B mapped read only from a file written by writePrepared. The mapping lives as long as the object, and is shared
+// with every other process that maps the same file. Throws std::runtime_error when the file can't be mapped or isn't a
+// prepared B.
+class MappedPrepared {
+  public:
+    explicit MappedPrepared(const std::string &path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd == -1) {
+        throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+      }
+      struct stat st;
+      if (fstat(fd, &st) == -1) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error("Can't stat " + path + ": " + std::strerror(error));
+      }
+      size_ = static_cast<size_t>(st.st_size);
+      if (size_ < sizeof(PreparedHeader)) {
+        close(fd);
+        throw std::runtime_error(path + " is too small to be a prepared B");
+      }
+      void * mapped = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+      int error = errno;
+      close(fd); // The mapping keeps the file open
+      if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Can't map " + path + ": " + std::strerror(error));
+      }
+      base_ = static_cast<const uint8_t *>(mapped);
+      try {
+        validate(path);
+      } catch (...) {
+        munmap(const_cast<uint8_t *>(base_), size_);
+        throw;
+      }
+    }
+
+    MappedPrepared(const MappedPrepared&) = delete;
+    MappedPrepared& operator=(const MappedPrepared&) = delete;
+
+    MappedPrepared(MappedPrepared &&other) : base_(other.base_), size_(other.size_) {
+      other.base_ = nullptr;
+      other.size_ = 0;
+    }
+
+    ~MappedPrepared() {
+      if (base_) {
+        munmap(const_cast<uint8_t *>(base_), size_);
+      }
+    }
+
+    const PreparedHeader &header() const { return *reinterpret_cast<const PreparedHeader *>(base_); }
+    size_t rowsB() const { return header().rowsB; }
+    size_t colsB() const { return header().colsB; }
+    float scale() const { return header().scale; }
+    uint32_t registerBits() const { return header().registerBits; }
+    PreparedLayout layout() const { return static_cast<PreparedLayout>(header().layout); }
+
+    // The prepared B, ready to be passed to the gemm that goes with the prepareB it was written with
+    const int8_t * data() const { return reinterpret_cast<const int8_t *>(base_ + header().dataOffset); }
+
+    // colsB corrections for a signed A, or nullptr if the file has none
+    const int32_t * correction() const {
+      return header().hasCorrection ? reinterpret_cast<const int32_t *>(base_ + header().correctionOffset) : nullptr;
+    }
+
+    // data(), after checking that it was prepared by Prepare
+    template<class Prepare>
+    const int8_t * data() const {
+      if (registerBits() != Prepare::registerBits || layout() != Prepare::layout
+          || header().dataSize != Prepare::preparedSize(rowsB(), colsB())) {
+        throw std::runtime_error("The prepared B was prepared for " + std::to_string(registerBits()) + " bit registers in layout "
+                                 + std::to_string(header().layout) + ", which doesn't match the requested prepareB");
+      }
+      return data();
+    }
+
+  private:
+    void validate(const std::string &path) const {
+      const PreparedHeader &h = header();
+      if (std::memcmp(h.magic, preparedMagic, sizeof(preparedMagic))) {
+        throw std::runtime_error(path + " is not a prepared B");
+      }
+      if (h.version != preparedVersion) {
+        throw std::runtime_error(path + " has version " + std::to_string(h.version) + ", expected " + std::to_string(preparedVersion));
+      }
+      if (h.dataOffset % preparedAlignment || h.dataOffset > size_ || h.dataSize > size_ - h.dataOffset) {
+        throw std::runtime_error(path + " is truncated or its prepared B is misplaced");
+      }
+      if (h.hasCorrection && (h.correctionOffset % preparedAlignment || h.correctionOffset > size_
+                              || h.colsB > (size_ - h.correctionOffset)/sizeof(int32_t))) {
+        throw std::runtime_error(path + " is truncated or its correction is misplaced");
+      }
+    }
+
+    const uint8_t * base_;
+    size_t size_;
+};
+
+} // namespace bftile
@@ -0,0 +1,198 @@
+#pragma once
+#include <immintrin.h>
+#include <algorithm>
+#include <cstdint>
+#include "utils.h"
+#include "accumulate.h"
+#include "epilogue.h"
+#include "mm512.h"
+#include "parallel.h"
+#include "targets.h"
+
+/************************************************************************************ block sparse B ************************************************************************************/
+// Pruned models have whole tiles of B that are zero, and the dense drivers multiply every one of them. This prepareB keeps only
+// the tiles of mm512::anyshape that have a nonzero weight, with an index of where they go, and the gemm walks only those. Time
+// and memory then go with the fraction of nonzero tiles. It is a separate layout, the dense one stays what it was.
+//
+// The prepared B is the index followed by the tiles, both in column block order:
+//   uint32_t begin[colBlocks + 1]  the first nonzero tile of every column block, so block b has begin[b + 1] - begin[b] of them
+//   uint32_t tile[begin[colBlocks]] for each nonzero tile where it is along the width, in tiles, ascending within a column block
+//   zeros up to a multiple of regwidth bytes, so the tiles stay aligned
+//   the nonzero tiles, numregs registers each as prepareBtile lays them out
+// preparedSize(rowsB, colsB) is the size with every tile nonzero, so the buffer fits any B of that shape, and
+// preparedSize(in, rowsB, colsB) the size for this B only.
+//
+// The column blocks depend on each other through the index, so there is no prepareBMatrixBlock and parallel<> can only be used
+// for the gemm (see parallelGemm).
+
+BFTILE_TARGET_AVX512VNNI_BEGIN
+namespace bftile {
+namespace sparse {
+namespace mm512 {
+
+template<class Accumulate>
+struct anyshapeWith {
+  typedef bftile::mm512::anyshapeWith<Accumulate> Dense;
+  typedef __m512i Register;
+  static const constexpr size_t regwidth = sizeof(Register); // We have two types of increments: incrementing by regwidth elements
+  static const constexpr size_t numregs = sizeof(Register)/4; // and increments by the number of registers of B that make up a single tile
+  static const constexpr uint32_t registerBits = 8*sizeof(Register); // What the prepared B looks like, for serialize.h
+  static const constexpr PreparedLayout layout = PreparedLayout::blockSparse;
+
+  static inline size_t colBlocks(size_t colsB) {
+    return (colsB + numregs - 1)/numregs;
+  }
+
+  // Bytes of the index in front of the tiles
+  static inline size_t indexSize(size_t colsB, size_t nonzeroTiles) {
+    const size_t bytes = (colBlocks(colsB) + 1 + nonzeroTiles)*sizeof(uint32_t);
+    return (bytes + regwidth - 1)/regwidth*regwidth;
+  }
+
+  // Whether the tile of B at column i and row j, zero padded like anyshape, has a nonzero weight
+  static inline bool nonzeroTile(const int8_t * in, size_t rowsB, size_t colsB, size_t i, size_t j) {
+    const __mmask64 rowmask = Dense::byteMask(rowsB - j);
+    Register any = _mm512_setzero_si512();
+    for (size_t t = 0; t < numregs && i + t < colsB; t++) {
+      any = _mm512_or_si512(any, _mm512_maskz_loadu_epi8(rowmask, &in[(i + t)*rowsB + j]));
+    }
+    return _mm512_test_epi8_mask(any, any) != 0;
+  }
+
+  static size_t nonzeroTiles(const int8_t * in, size_t rowsB, size_t colsB) {
+    size_t count = 0;
+    for (size_t i = 0; i < colsB; i += numregs) {
+      for (size_t j = 0; j < rowsB; j += regwidth) {
+        count += nonzeroTile(in, rowsB, colsB, i, j);
+      }
+    }
+    return count;
+  }
+
+  // Size in bytes for any B of this shape, which is a bit more than anyshape's
+  static size_t preparedSize(size_t rowsB, size_t colsB) {
+    const size_t tiles = Dense::tilesPerColumn(rowsB)*colBlocks(colsB);
+    return indexSize(colsB, tiles) + tiles*numregs*regwidth;
+  }
+
+  // Size in bytes for this B
+  static size_t preparedSize(const int8_t * in, size_t rowsB, size_t colsB) {
+    const size_t tiles = nonzeroTiles(in, rowsB, colsB);
+    return indexSize(colsB, tiles) + tiles*numregs*regwidth;
+  }
+
+  static void prepareBMatrix(const int8_t * in, int8_t * out, size_t rowsB, size_t colsB) {
+    const size_t nonzero = nonzeroTiles(in, rowsB, colsB);
+    const size_t indexBytes = indexSize(colsB, nonzero);
+    uint32_t * begin = reinterpret_cast<uint32_t *>(out);
+    uint32_t * tileIndex = begin + colBlocks(colsB) + 1;
+    std::fill(out + (tileIndex + nonzero - begin)*sizeof(uint32_t), out + indexBytes, 0);
+    Register * outmat = reinterpret_cast<Register *>(out + indexBytes);
+    const bool stream = streamPrepared(out, indexBytes + nonzero*numregs*regwidth, regwidth);
+    Register intile[numregs];
+    Register outtile[numregs];
+    uint32_t count = 0;
+    for (size_t i = 0; i < colsB; i += numregs) {
+      begin[i/numregs] = count;
+      for (size_t j = 0; j < rowsB; j += regwidth) {
+        if (!nonzeroTile(in, rowsB, colsB, i, j)) {
+          continue;
+        }
+        __mmask64 rowmask = Dense::byteMask(rowsB - j);
+        for (size_t t = 0; t < numregs; t++) {
+          intile[t] = i + t < colsB ? _mm512_maskz_loadu_epi8(rowmask, &in[(i + t)*rowsB + j]) : _mm512_setzero_si512();
+        }
+        bftile::mm512::prepareBtile(intile, outtile);
+        bftile::mm512::storeTile(outtile, outmat, stream);
+        outmat = outmat + numregs;
+        tileIndex[count++] = static_cast<uint32_t>(j/regwidth);
+      }
+    }
+    begin[colBlocks(colsB)] = count;
+    if (stream) {
+      _mm_sfence(); // Streaming stores are weakly ordered, make sure they are all visible before anyone reads the matrix
+    }
+  }
+
+  // Also writes the colsB column sum corrections that gemmShifted needs for a signed A
+  static void prepareBMatrix(const int8_t * in, int8_t * out, int32_t * correction, size_t rowsB, size_t colsB) {
+    prepareBMatrix(in, out, rowsB, colsB);
+    prepareShiftCorrection(in, correction, rowsB, colsB);
+  }
+
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemmBlock(A, B, C, width, colsB, 0, rowsA, 0, colsB, 0, width);
+  }
+
+  // C is whatever the epilogue (see epilogue.h) makes of the product, for example dequantized floats
+  template<class Epilogue>
+  __attribute__((flatten)) static void gemm(const uint8_t * A, const int8_t * B, size_t rowsA, size_t width, size_t colsB, const Epilogue &epilogue) {
+    gemmBlock(A, B, width, colsB, 0, rowsA, 0, colsB, 0, width, epilogue);
+  }
+
+  // Signed int8 A, with the correction from prepareBMatrix above. The result is exact, see ShiftedA.
+  static void gemmShifted(const int8_t * A, const int8_t * B, const int32_t * correction, int32_t * C, size_t rowsA, size_t width, size_t colsB) {
+    /****** Important: C is assumed to be set to 0 ******/
+    gemm(reinterpret_cast<const uint8_t *>(A), B, rowsA, width, colsB, shiftedA(correction, AccumulateC(C, colsB)));
+  }
+
+  // Same contract as anyshape::gemmBlock
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, int32_t * C, size_t width, size_t colsB,
+                                                 size_t rowBegin, size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd) {
+    gemmBlock(A, B, width, colsB, rowBegin, rowEnd, colBegin, colEnd, kBegin, kEnd, AccumulateC(C, colsB));
+  }
+
+  // anyshape::gemmBlock over the nonzero tiles only. A C tile whose column block has none in [kBegin, kEnd) still goes through
+  // the epilogue.
+  template<class Epilogue>
+  __attribute__((flatten)) static void gemmBlock(const uint8_t * A, const int8_t * B, size_t width, size_t colsB, size_t rowBegin,
+                                                 size_t rowEnd, size_t colBegin, size_t colEnd, size_t kBegin, size_t kEnd, const Epilogue &epilogue) {
+    const uint32_t * begin = reinterpret_cast<const uint32_t *>(B);
+    const uint32_t * tileIndex = begin + colBlocks(colsB) + 1;
+    const Register * tiles = reinterpret_cast<const Register *>(B + indexSize(colsB, begin[colBlocks(colsB)]));
+    Register cres[numregs];
+    for (size_t j = colBegin; j < colEnd; j += numregs) { // 64/4=16
+      const __mmask16 colmask = Dense::columnMask(colEnd - j);
+      // The tiles of this column block in [kBegin, kEnd), which are sorted along the width
+      const uint32_t * first = std::lower_bound(tileIndex + begin[j/numregs], tileIndex + begin[j/numregs + 1], kBegin/regwidth);
+      const uint32_t * last = std::lower_bound(first, tileIndex + begin[j/numregs + 1], (kEnd + regwidth - 1)/regwidth);
+      for (size_t i = rowBegin; i < rowEnd; i += numregs) { // 64/4=16
+        const size_t rows = rowEnd - i < numregs ? rowEnd - i : numregs;
+        for (size_t n = 0; n < rows; n++) {
+          epilogue.init(cres[n], i+n, j, colmask);
+        }
+        for (const uint32_t * tile = first; tile != last; tile++) {
+          const size_t t = *tile*regwidth;
+          const __mmask64 amask = Dense::byteMask(width - t);
+          const Register * breord_cur = tiles + (tile - tileIndex)*numregs;
+          for (size_t n = 0; n < rows; n++) {
+            bftile::mm512::depthfirstaddrlooptileloopwritedependWith<Accumulate>::multiplyRowSeqWrite(
+                Dense::template loadA<Epilogue>(amask, A + (i+n)*width + t), breord_cur, cres[n]);
+          }
+        }
+        for (size_t n = 0; n < rows; n++) {
+          epilogue.finish(cres[n], i+n, j, colmask);
+        }
+      }
+    }
+  }
+
+  struct runner {
+    using gemm = anyshapeWith<Accumulate>;
+    using prepareB = anyshapeWith<Accumulate>;
+  };
+}; //struct anyshape
+typedef anyshapeWith<Saturating> anyshape;
+
+// parallel<> for the gemm with the serial prepareB, since the column blocks of the index can't be prepared on their own
+template<class Runner>
+struct parallelGemm {
+  using gemm = typename bftile::parallel<Runner>::runner::gemm;
+  using prepareB = typename Runner::prepareB;
+};
+
+} // namespace mm512
+} // namespace sparse
+} // namespace bftile
+BFTILE_TARGET_END
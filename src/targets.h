@@ -0,0 +1,36 @@
+#pragma once
+
+/************************************************************************************ targets ************************************************************************************/
+// The kernels are compiled without -march=native. Instead every function in a kernel header carries a target attribute,
+// applied with a pragma around the whole block, so one binary can contain all kernel families and pick one at runtime.
+// Always include system headers before opening a target block, otherwise their inline functions get the target too.
+//
+// AVX2 and AVX512BW are for the fallbacks of maddubs.h, on CPUs without VNNI. Both are subsets of the VNNI target, so helpers
+// compiled for them (like the B tile shuffles the families share) still inline into the VNNI kernels, just not the other way around.
+// AVXVNNI is the VEX encoded VNNI of the cores without AVX512 (see avxvnni.h), AVX2 plus the 256 bit dpbusd.
+
+#if defined(__clang__)
+#define BFTILE_TARGET_AVX512VNNI_BEGIN \
+  _Pragma("clang attribute push (__attribute__((target(\"avx512f,avx512bw,avx512dq,avx512vl,avx512vnni,fma\"))), apply_to = function)")
+#define BFTILE_TARGET_AVX512BW_BEGIN \
+  _Pragma("clang attribute push (__attribute__((target(\"avx512f,avx512bw,avx512dq,avx512vl,fma\"))), apply_to = function)")
+#define BFTILE_TARGET_AVXVNNI_BEGIN \
+  _Pragma("clang attribute push (__attribute__((target(\"avx2,fma,avxvnni\"))), apply_to = function)")
+#define BFTILE_TARGET_AVX2_BEGIN \
+  _Pragma("clang attribute push (__attribute__((target(\"avx2,fma\"))), apply_to = function)")
+#define BFTILE_TARGET_END _Pragma("clang attribute pop")
+#else
+#define BFTILE_TARGET_AVX512VNNI_BEGIN \
+  _Pragma("GCC push_options") \
+  _Pragma("GCC target(\"avx512f,avx512bw,avx512dq,avx512vl,avx512vnni,fma\")")
+#define BFTILE_TARGET_AVX512BW_BEGIN \
+  _Pragma("GCC push_options") \
+  _Pragma("GCC target(\"avx512f,avx512bw,avx512dq,avx512vl,fma\")")
+#define BFTILE_TARGET_AVXVNNI_BEGIN \
+  _Pragma("GCC push_options") \
+  _Pragma("GCC target(\"avx2,fma,avxvnni\")")
+#define BFTILE_TARGET_AVX2_BEGIN \
+  _Pragma("GCC push_options") \
+  _Pragma("GCC target(\"avx2,fma\")")
+#define BFTILE_TARGET_END _Pragma("GCC pop_options")
+#endif
@@ -0,0 +1,148 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bftile {
+/************************************************************************************ thread pool ************************************************************************************/
+
+// Persistent pool of worker threads. The workers sleep on a condition variable between jobs, so a gemm call only pays for a wake up
+// and never for creating threads. The thread that calls run() takes part in the work as well, so a pool of size N has N-1 workers.
+class ThreadPool {
+  public:
+    explicit ThreadPool(size_t threads) {
+      for (size_t i = 1; i < std::max<size_t>(threads, 1); i++) {
+        workers_.emplace_back([this]() { workerLoop(); });
+      }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      wake_.notify_all();
+      for (auto&& worker : workers_) {
+        worker.join();
+      }
+    }
+
+    size_t size() const { return workers_.size() + 1; }
+
+    // Calls task(n) for every n in [0, tasks) and returns once all of them are done. Tasks are handed out one at a time
+    // so threads that finish early pick up the remaining ones. Not reentrant: task must not call run() on the same pool.
+    void run(size_t tasks, const std::function<void(size_t)> &task) {
+      if (tasks == 0) {
+        return;
+      }
+      if (tasks == 1 || workers_.empty()) {
+        for (size_t n = 0; n < tasks; n++) {
+          task(n);
+        }
+        return;
+      }
+      std::lock_guard<std::mutex> serialise(runMutex_); // One job at a time
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        task_ = &task;
+        tasks_ = tasks;
+        next_ = 0;
+        busy_ = workers_.size();
+        generation_++;
+      }
+      wake_.notify_all();
+      work();
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this]() { return busy_ == 0; });
+      task_ = nullptr;
+    }
+
+    // Process wide pool. Its size is taken from BFTILE_NUM_THREADS, or the number of physical cores if that is unset.
+    static ThreadPool &instance() {
+      static ThreadPool pool(defaultSize());
+      return pool;
+    }
+
+    static size_t defaultSize() {
+      if (const char *env = std::getenv("BFTILE_NUM_THREADS")) {
+        long requested = std::strtol(env, nullptr, 10);
+        if (requested > 0) {
+          return static_cast<size_t>(requested);
+        }
+      }
+      if (size_t cores = physicalCores()) {
+        return cores;
+      }
+      return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+
+    // hardware_concurrency counts SMT siblings, which share the one set of vnni units of their core, so a second thread on a
+    // core adds nothing but contention. This counts the distinct (package, core) pairs of the online cpus in
+    // /sys/devices/system/cpu instead, and is 0 where that isn't there.
+    static size_t physicalCores() {
+      const size_t online = std::thread::hardware_concurrency();
+      std::set<std::pair<long, long>> cores;
+      size_t found = 0;
+      for (size_t cpu = 0; cpu < 4096 && found < online; cpu++) {
+        const std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        std::ifstream package(topology + "physical_package_id"), core(topology + "core_id");
+        long packageId, coreId;
+        if (package >> packageId && core >> coreId) {
+          cores.emplace(packageId, coreId);
+          found++;
+        }
+      }
+      return cores.size();
+    }
+
+  private:
+    void work() {
+      for (size_t n = next_.fetch_add(1); n < tasks_; n = next_.fetch_add(1)) {
+        (*task_)(n);
+      }
+    }
+
+    void workerLoop() {
+      size_t seen = 0;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          wake_.wait(lock, [this, seen]() { return stop_ || generation_ != seen; });
+          if (stop_) {
+            return;
+          }
+          seen = generation_;
+        }
+        work();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--busy_ == 0) {
+          done_.notify_one();
+        }
+      }
+    }
+
+    std::vector<std::thread> workers_;
+    std::mutex runMutex_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(size_t)> *task_ = nullptr;
+    size_t tasks_ = 0;
+    std::atomic<size_t> next_{0};
+    size_t busy_ = 0;
+    size_t generation_ = 0;
+    bool stop_ = false;
+};
+} // namespace bftile
@@ -1,7 +1,11 @@
 #pragma once
+#include <algorithm>
 #include <iostream>
 #include <stdlib.h>
 #include <math.h>
+#include <vector>
+#include <cstdint>
+#include "threadpool.h"
 
 /************************************************************************************ util ************************************************************************************/
 namespace bftile {
@@ -67,9 +71,106 @@ void gemmRowMColM(intType1 *A, intType2 * B, size_t rowsA, size_t width, size_t
   }
 }
 
+// Blocking of gemmReference: referenceKC of the width of referenceNC columns of B, widened to int16, is 512KB that stays in L2
+// while referenceMC rows of A go past it. referenceKC also keeps every partial sum well inside the int32 range.
+static const constexpr size_t referenceKC = 2048;
+static const constexpr size_t referenceNC = 128;
+static const constexpr size_t referenceMC = 32;
+
+// Four dot products of length n, of one row of A with four columns of B, all widened to int16. A plain loop that the compiler
+// vectorizes for whatever the build targets: int16 products summed into int32 is the pattern it turns into pmaddwd (or
+// vpmaddwd), and the row of A is read once for all four columns.
+inline void referenceDot4(const int16_t * a, const int16_t * b0, const int16_t * b1, const int16_t * b2, const int16_t * b3, size_t n,
+                          int32_t * sums) {
+  int32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (size_t w = 0; w < n; w++) {
+    s0 += a[w]*b0[w];
+    s1 += a[w]*b1[w];
+    s2 += a[w]*b2[w];
+    s3 += a[w]*b3[w];
+  }
+  sums[0] = s0;
+  sums[1] = s1;
+  sums[2] = s2;
+  sums[3] = s3;
+}
+
+inline int32_t referenceDot(const int16_t * a, const int16_t * b, size_t n) {
+  int32_t sum = 0;
+  for (size_t w = 0; w < n; w++) {
+    sum += a[w]*b[w];
+  }
+  return sum;
+}
+
+// Adds in uint32, so that C wraps around at the int32 range like dpbusd does instead of being undefined
+inline int32_t referenceAdd(int32_t c, int32_t sum) {
+  return static_cast<int32_t>(static_cast<uint32_t>(c) + static_cast<uint32_t>(sum));
+}
+
+// C += A*B for a row major A (uint8, or int8 for a signed A) and a column major B, as gemmRowMColM but fast enough to check the
+// kernels on full size shapes. It shares nothing with the kernels: no reordering, no intrinsics, only dot products along the
+// width. Those are cache blocked (see referenceKC) and spread over the pool in tiles of referenceMC rows by referenceNC columns.
+// Sums wrap around at the int32 range like the NonSaturating kernels, which is also what the Saturating ones give as long as
+// no running sum leaves it.
+template<class AType>
+void gemmReference(const AType * A, const int8_t * B, int32_t * C, size_t rowsA, size_t width, size_t colsB,
+                   ThreadPool &pool = ThreadPool::instance()) {
+  const size_t rowBlocks = (rowsA + referenceMC - 1)/referenceMC;
+  const size_t colPanels = (colsB + referenceNC - 1)/referenceNC;
+  auto tile = [&](size_t task) {
+    const size_t rowBegin = (task / colPanels)*referenceMC;
+    const size_t rowEnd = std::min(rowBegin + referenceMC, rowsA);
+    const size_t colBegin = (task % colPanels)*referenceNC;
+    const size_t colEnd = std::min(colBegin + referenceNC, colsB);
+    std::vector<int16_t> panel(std::min(referenceKC, width)*(colEnd - colBegin));
+    std::vector<int16_t> row(std::min(referenceKC, width));
+    for (size_t k = 0; k < width; k += referenceKC) {
+      const size_t kc = std::min(referenceKC, width - k);
+      for (size_t j = colBegin; j < colEnd; j++) {
+        std::copy(B + j*width + k, B + j*width + k + kc, panel.begin() + (j - colBegin)*kc);
+      }
+      for (size_t i = rowBegin; i < rowEnd; i++) {
+        std::copy(A + i*width + k, A + i*width + k + kc, row.begin());
+        int32_t * c = C + i*colsB;
+        const int16_t * b = panel.data() - colBegin*kc; // Indexed by the column of B
+        size_t j = colBegin;
+        for (; j + 4 <= colEnd; j += 4) {
+          int32_t sums[4];
+          referenceDot4(row.data(), b + j*kc, b + (j + 1)*kc, b + (j + 2)*kc, b + (j + 3)*kc, kc, sums);
+          for (size_t n = 0; n < 4; n++) {
+            c[j + n] = referenceAdd(c[j + n], sums[n]);
+          }
+        }
+        for (; j < colEnd; j++) {
+          c[j] = referenceAdd(c[j], referenceDot(row.data(), b + j*kc, kc));
+        }
+      }
+    }
+  };
+  pool.run(rowBlocks*colPanels, tile);
+}
+
 struct matrix {
   size_t aRows;
   size_t width;
   size_t bCols;
 };
+
+// How a prepareB lays out the reordered B. Recorded in serialized matrices (see serialize.h), since a B prepared by one
+// kind of prepareB or for one register width only makes sense to the gemm that goes with it.
+enum class PreparedLayout : uint32_t {
+  depthfirst = 1, // Column blocks of numregs columns, tiles of regwidth rows, rowsB a multiple of regwidth and colsB of numregs
+  anyshape = 2,   // The same with the last tile of every column block and the last column block zero padded
+  packedInt4 = 3, // anyshape with every two registers of a tile packed into one of 4 bit weights, see int4.h
+  blockSparse = 4  // anyshape without its all zero tiles, behind an index of the others, see sparse.h
+};
+
+// Prepared matrices at least this big are written with streaming stores, they won't stay in the cache until gemm reads them anyway
+static const constexpr size_t streamPreparedBytes = 4 << 20;
+
+// Whether prepareBMatrix should write bytes of output at out with streaming stores. Those need out aligned to a register.
+inline bool streamPrepared(const void * out, size_t bytes, size_t regwidth) {
+  return bytes >= streamPreparedBytes && reinterpret_cast<uintptr_t>(out) % regwidth == 0;
+}
 } // namespace bftile